@@ -0,0 +1,242 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+void *malloc_alloc(Plea_Allocator *allocator, size_t size, Alloc_Site site) {
+    (void)allocator;
+    (void)site;
+    return malloc(size);
+}
+
+void *malloc_resize(Plea_Allocator *allocator, void *ptr, size_t size, Alloc_Site site) {
+    (void)allocator;
+    (void)site;
+    return realloc(ptr, size);
+}
+
+void malloc_release(Plea_Allocator *allocator, void *ptr) {
+    (void)allocator;
+    free(ptr);
+}
+
+Plea_Allocator plea_malloc_allocator = {
+    .alloc = malloc_alloc,
+    .resize = malloc_resize,
+    .release = malloc_release,
+    .data = NULL,
+};
+
+static Plea_Allocator *plea_allocator = &plea_malloc_allocator;
+
+void plea_set_allocator(Plea_Allocator *allocator) {
+    plea_allocator = allocator;
+}
+
+Plea_Allocator *plea_get_allocator(void) {
+    return plea_allocator;
+}
+
+void out_of_memory(void) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+}
+
+void *plea_alloc(Alloc_Site site, size_t size) {
+    void *ptr = plea_allocator->alloc(plea_allocator, size, site);
+    if (ptr == NULL && size > 0) out_of_memory();
+    return ptr;
+}
+
+void *plea_calloc(Alloc_Site site, size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) out_of_memory();
+    void *ptr = plea_alloc(site, count * size);
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void *plea_realloc(Alloc_Site site, void *ptr, size_t size) {
+    if (ptr == NULL) return plea_alloc(site, size);
+    ptr = plea_allocator->resize(plea_allocator, ptr, size, site);
+    if (ptr == NULL && size > 0) out_of_memory();
+    return ptr;
+}
+
+void plea_free(void *ptr) {
+    if (ptr) plea_allocator->release(plea_allocator, ptr);
+}
+
+char *plea_strdup(Alloc_Site site, const char *str) {
+    size_t length = strlen(str)+1;
+    char *dup = plea_alloc(site, length);
+    memcpy(dup, str, length);
+    return dup;
+}
+
+/* Each block carries its size and site in front, so frees and resizes can
+ * be accounted without a lookup */
+typedef struct {
+    size_t size;
+    size_t site;
+} Mem_Header;
+
+typedef struct {
+    size_t allocs;
+    size_t resizes;
+    size_t frees;
+    size_t live_count;
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t halt_count;
+    size_t halt_bytes;
+} Site_Stats;
+
+typedef struct {
+    Plea_Allocator *parent;
+    FILE *out;
+    pthread_mutex_t lock;
+    Site_Stats sites[ALLOC_SITES];
+    size_t live_bytes;
+    size_t peak_bytes;
+    int halted;
+} Mem_Profile;
+
+static Mem_Profile mem_profile;
+static Plea_Allocator mem_profile_allocator;
+
+void mem_profile_add(Mem_Header *header, size_t size, Alloc_Site site) {
+    header->size = size;
+    header->site = site;
+
+    Site_Stats *stats = &mem_profile.sites[site];
+    stats->live_count++;
+    stats->live_bytes += size;
+    if (stats->live_bytes > stats->peak_bytes) stats->peak_bytes = stats->live_bytes;
+
+    mem_profile.live_bytes += size;
+    if (mem_profile.live_bytes > mem_profile.peak_bytes) mem_profile.peak_bytes = mem_profile.live_bytes;
+}
+
+void mem_profile_remove(Mem_Header *header) {
+    Site_Stats *stats = &mem_profile.sites[header->site];
+    stats->live_count--;
+    stats->live_bytes -= header->size;
+    mem_profile.live_bytes -= header->size;
+}
+
+void *mem_profile_alloc(Plea_Allocator *allocator, size_t size, Alloc_Site site) {
+    (void)allocator;
+    Mem_Header *header = mem_profile.parent->alloc(mem_profile.parent, sizeof(Mem_Header) + size, site);
+    if (header == NULL) return NULL;
+
+    pthread_mutex_lock(&mem_profile.lock);
+    mem_profile.sites[site].allocs++;
+    mem_profile_add(header, size, site);
+    pthread_mutex_unlock(&mem_profile.lock);
+    return header + 1;
+}
+
+/* A block keeps the site it was allocated at */
+void *mem_profile_resize(Plea_Allocator *allocator, void *ptr, size_t size, Alloc_Site site) {
+    (void)allocator;
+    Mem_Header *header = (Mem_Header *)ptr - 1;
+    Mem_Header old = *header;
+
+    header = mem_profile.parent->resize(mem_profile.parent, header, sizeof(Mem_Header) + size, site);
+    if (header == NULL) return NULL;
+
+    pthread_mutex_lock(&mem_profile.lock);
+    mem_profile.sites[old.site].resizes++;
+    mem_profile_remove(&old);
+    mem_profile_add(header, size, old.site);
+    pthread_mutex_unlock(&mem_profile.lock);
+    return header + 1;
+}
+
+void mem_profile_release(Plea_Allocator *allocator, void *ptr) {
+    (void)allocator;
+    Mem_Header *header = (Mem_Header *)ptr - 1;
+
+    pthread_mutex_lock(&mem_profile.lock);
+    mem_profile.sites[header->site].frees++;
+    mem_profile_remove(header);
+    pthread_mutex_unlock(&mem_profile.lock);
+
+    mem_profile.parent->release(mem_profile.parent, header);
+}
+
+const char *site_name(Alloc_Site site) {
+    switch (site) {
+    case SITE_TOKENS:      return "tokens";
+    case SITE_NAMES:       return "names";
+    case SITE_CODE:        return "code";
+    case SITE_LINES:       return "lines";
+    case SITE_CONSTANTS:   return "constants";
+    case SITE_FUNCTIONS:   return "functions";
+    case SITE_VARS:        return "vars";
+    case SITE_ANALYSIS:    return "analysis";
+    case SITE_PASSES:      return "passes";
+    case SITE_POOL:        return "pool";
+    case SITE_SCOPES:      return "scopes";
+    case SITE_ARRAYS:      return "arrays";
+    case SITE_ARRAY_ITEMS: return "array items";
+    case SITE_WHENS:       return "whens";
+    case SITE_SNAPSHOT:    return "snapshot";
+    case SITE_VMS:         return "vms";
+    default:               return "?";
+    }
+}
+
+void mem_profile_report(void) {
+    FILE *out = mem_profile.out;
+    size_t leaked_count = 0;
+    size_t leaked_bytes = 0;
+
+    fprintf(out, "%-12s %10s %10s %10s %12s %14s %12s\n", "site", "allocs", "resizes", "frees", "peak bytes", "live at halt", "leaked bytes");
+    for (int i = 0; i < ALLOC_SITES; i++) {
+        Site_Stats *stats = &mem_profile.sites[i];
+        if (stats->allocs == 0) continue;
+        fprintf(out, "%-12s %10zu %10zu %10zu %12zu %14zu %12zu\n", site_name(i),
+                stats->allocs, stats->resizes, stats->frees, stats->peak_bytes, stats->halt_count, stats->live_bytes);
+        leaked_count += stats->live_count;
+        leaked_bytes += stats->live_bytes;
+    }
+
+    fprintf(out, "peak: %zu bytes\n", mem_profile.peak_bytes);
+    if (mem_profile.halted) {
+        Site_Stats *arrays = &mem_profile.sites[SITE_ARRAYS];
+        Site_Stats *items = &mem_profile.sites[SITE_ARRAY_ITEMS];
+        fprintf(out, "live arrays at halt: %zu, %zu bytes\n", arrays->halt_count, arrays->halt_bytes + items->halt_bytes);
+    }
+    fprintf(out, "leaked: %zu allocations, %zu bytes\n", leaked_count, leaked_bytes);
+}
+
+void mem_profile_start(FILE *out) {
+    mem_profile.parent = plea_get_allocator();
+    mem_profile.out = out;
+    pthread_mutex_init(&mem_profile.lock, NULL);
+
+    mem_profile_allocator = (Plea_Allocator){
+        .alloc = mem_profile_alloc,
+        .resize = mem_profile_resize,
+        .release = mem_profile_release,
+        .data = &mem_profile,
+    };
+    plea_set_allocator(&mem_profile_allocator);
+    atexit(mem_profile_report);
+}
+
+/* Called by the VM when the program halts, before it frees its frame */
+void mem_profile_snapshot(void) {
+    if (plea_get_allocator() != &mem_profile_allocator) return;
+
+    pthread_mutex_lock(&mem_profile.lock);
+    for (int i = 0; i < ALLOC_SITES; i++) {
+        mem_profile.sites[i].halt_count = mem_profile.sites[i].live_count;
+        mem_profile.sites[i].halt_bytes = mem_profile.sites[i].live_bytes;
+    }
+    mem_profile.halted = 1;
+    pthread_mutex_unlock(&mem_profile.lock);
+}
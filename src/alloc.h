@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* What an allocation is for, so a profile can break memory use down */
+typedef enum {
+    SITE_TOKENS,
+    SITE_NAMES,
+    SITE_CODE,
+    SITE_LINES,
+    SITE_CONSTANTS,
+    SITE_FUNCTIONS,
+    SITE_VARS,
+    SITE_ANALYSIS,
+    SITE_PASSES,
+    SITE_POOL,
+    SITE_SCOPES,
+    SITE_ARRAYS,
+    SITE_ARRAY_ITEMS,
+    SITE_WHENS,
+    SITE_SNAPSHOT,
+    SITE_VMS,
+    ALLOC_SITES
+} Alloc_Site;
+
+/* Every allocation of the lexer, compiler and VM goes through the current
+ * allocator. It has to be set before the first allocation and stay until
+ * the last free, and calls may come from several compile threads at once. */
+typedef struct Plea_Allocator Plea_Allocator;
+struct Plea_Allocator {
+    void *(*alloc)(Plea_Allocator *allocator, size_t size, Alloc_Site site);
+    void *(*resize)(Plea_Allocator *allocator, void *ptr, size_t size, Alloc_Site site);
+    void (*release)(Plea_Allocator *allocator, void *ptr);
+    void *data;
+};
+
+extern Plea_Allocator plea_malloc_allocator;
+
+void plea_set_allocator(Plea_Allocator *allocator);
+Plea_Allocator *plea_get_allocator(void);
+
+void *plea_alloc(Alloc_Site site, size_t size);
+void *plea_calloc(Alloc_Site site, size_t count, size_t size);
+void *plea_realloc(Alloc_Site site, void *ptr, size_t size);
+void plea_free(void *ptr);
+char *plea_strdup(Alloc_Site site, const char *str);
+
+/* Wraps the current allocator to count allocations, frees and peak bytes
+ * per site; the report is written to out when the process exits */
+void mem_profile_start(FILE *out);
+void mem_profile_snapshot(void);
@@ -4,54 +4,89 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include "alloc.h"
 #include "compiler.h"
 
-#define da_append(a,i,n)                                                    \
-    do {                                                                    \
-        if ((a)->count == (a)->capacity) {                                  \
-            (a)->capacity *= 2;                                             \
-            if ((a)->capacity == 0) (a)->capacity = 4;                      \
-            (a)->n = realloc((a)->n, (a)->capacity * sizeof(*((a)->n)));    \
-            assert((a)->n != NULL);                                         \
-        }                                                                   \
-        (a)->n[(a)->count] = i;                                             \
-        (a)->count++;                                                       \
+/* da_append tags what it grows by the name of the array */
+#define SITE_OF_bytes     SITE_CODE
+#define SITE_OF_positions SITE_LINES
+#define SITE_OF_constants SITE_CONSTANTS
+#define SITE_OF_functions SITE_FUNCTIONS
+#define SITE_OF_lines     SITE_ANALYSIS
+#define SITE_OF_edges     SITE_ANALYSIS
+#define SITE_OF_whens     SITE_PASSES
+#define SITE_OF_units     SITE_POOL
+#define SITE_OF_deltas    SITE_LINES
+
+#define da_append(a,i,n)                                                                    \
+    do {                                                                                    \
+        if ((a)->count == (a)->capacity) {                                                  \
+            (a)->capacity *= 2;                                                             \
+            if ((a)->capacity == 0) (a)->capacity = 4;                                      \
+            (a)->n = plea_realloc(SITE_OF_##n, (a)->n, (a)->capacity * sizeof(*((a)->n)));  \
+        }                                                                                   \
+        (a)->n[(a)->count] = i;                                                             \
+        (a)->count++;                                                                       \
     } while (0)
 
-char *plea_strdup(char *str) {
-    size_t length = strlen(str)+1;
-    char *dup = malloc(length);
-    if (!dup) return NULL;
-    memcpy(dup, str, length);
-    return dup;
-}
-
-void add_constant(Constant_List *constant_list, int val) {
+void add_constant_value(Constant_List *constant_list, Value val) {
     if (constant_list->count == constant_list->capacity) {
         constant_list->capacity *= 2;
-        constant_list->constants = realloc(constant_list->constants, constant_list->capacity * sizeof(Value));
-        assert(constant_list->constants != NULL);
+        constant_list->constants = plea_realloc(SITE_CONSTANTS, constant_list->constants, constant_list->capacity * sizeof(Value));
     }
-    constant_list->constants[constant_list->count].as.integer = val;
+    constant_list->constants[constant_list->count] = val;
     constant_list->count++;
 }
 
+void add_constant(Constant_List *constant_list, int val) {
+    add_constant_value(constant_list, value_int(val));
+}
+
+void add_real_constant(Constant_List *constant_list, float val) {
+    add_constant_value(constant_list, value_real(val));
+}
+
 void add_function(Function_List *function_list, char *name, int location) {
     if (function_list->count == function_list->capacity) {
         function_list->capacity *= 2;
-        function_list->functions = realloc(function_list->functions, function_list->capacity * sizeof(Function));
+        function_list->functions = plea_realloc(SITE_FUNCTIONS, function_list->functions, function_list->capacity * sizeof(Function));
         assert(function_list->functions != NULL);
     }
     function_list->functions[function_list->count] = (Function){
-        .name = plea_strdup(name),
+        .name = plea_strdup(SITE_FUNCTIONS, name),
         .location = location,
         .arity = 0,
-        .vars = malloc(256 * sizeof(Var)),
-        .vars_count = 0
+        .stack_args = 0,
+        .vars = plea_alloc(SITE_VARS, 256 * sizeof(Var)),
+        .vars_count = 0,
+        .inline_tokens = -1,
+        .max_depth = -1
     };
     function_list->count++;
 }
 
+/* Every variable owns its name, so a copy of the slots copies the names */
+Var *copy_vars(Var *vars, int count, size_t capacity) {
+    Var *copy = plea_alloc(SITE_VARS, capacity * sizeof(Var));
+    for (int i = 0; i < count; i++) {
+        copy[i] = vars[i];
+        copy[i].name = plea_strdup(SITE_VARS, vars[i].name);
+    }
+    return copy;
+}
+
+void free_vars(Var *vars, int count) {
+    if (!vars) return;
+    for (int i = 0; i < count; i++) plea_free(vars[i].name);
+    plea_free(vars);
+}
+
+/* Forgets the variables declared from count on, like a call's arguments */
+void drop_vars(Function *function, int count) {
+    for (int i = count; i < function->vars_count; i++) plea_free(function->vars[i].name);
+    function->vars_count = count;
+}
+
 void add_bytes(Code *code, int num_bytes, ...) {
     va_list args;
     va_start(args, num_bytes);
@@ -71,32 +106,40 @@ void add_string(Code *code, char *str) {
 
 Token consume_token(Compiler *compiler) {
     compiler->pos++;
-    return compiler->tokens->toks[compiler->pos];
+    return token_at(compiler->tokens, compiler->pos);
 }
 
 Token peek_token(Compiler *compiler) {
-    return compiler->tokens->toks[compiler->pos+1];
+    return token_at(compiler->tokens, compiler->pos+1);
 }
 
 Token cur_token(Compiler *compiler) {
-    return compiler->tokens->toks[compiler->pos];
+    return token_at(compiler->tokens, compiler->pos);
+}
+
+/* Where the token being compiled is in the source, ahead of an error */
+void print_position(Compiler *compiler) {
+    int line, col;
+    token_position(compiler->tokens, cur_token(compiler), &line, &col);
+    fprintf(stderr, "%d:%d: ", line, col);
 }
 
 void error(Compiler *compiler, char *message, int line) {
     int pos = compiler->pos-1;
-    while (compiler->tokens->toks[pos].kind != THEN
-        && compiler->tokens->toks[pos].kind != CALLS
-        && compiler->tokens->toks[pos].kind != FNCTN
-        && compiler->tokens->toks[pos].kind != BEG) {
+    while (token_at(compiler->tokens, pos).kind != THEN
+        && token_at(compiler->tokens, pos).kind != CALLS
+        && token_at(compiler->tokens, pos).kind != FNCTN
+        && token_at(compiler->tokens, pos).kind != BEG) {
         pos--;
     }
     pos++;
 
-    while (compiler->tokens->toks[pos].kind != THEN && compiler->tokens->toks[pos].kind != SEMICOLON && compiler->tokens->toks[pos].kind != CALLS) {
-        if (compiler->tokens->toks[pos].kind == CATCH && compiler->tokens->toks[pos+1].kind == ERROR) return;
+    while (token_at(compiler->tokens, pos).kind != THEN && token_at(compiler->tokens, pos).kind != SEMICOLON && token_at(compiler->tokens, pos).kind != CALLS) {
+        if (token_at(compiler->tokens, pos).kind == CATCH && token_at(compiler->tokens, pos+1).kind == ERROR) return;
         pos++;
     }
 
+    print_position(compiler);
 #ifdef PLEA_DEBUG
     fprintf(stderr, "%d: %s\n", line, message);
 #else
@@ -109,19 +152,20 @@ void expect_token(Compiler *compiler, Token_Kind token_kind) {
     compiler->pos++;
     if (cur_token(compiler).kind != token_kind) {
         int pos = compiler->pos-1;
-        while (compiler->tokens->toks[pos].kind != THEN
-            && compiler->tokens->toks[pos].kind != CALLS
-            && compiler->tokens->toks[pos].kind != FNCTN
-            && compiler->tokens->toks[pos].kind != BEG) {
+        while (token_at(compiler->tokens, pos).kind != THEN
+            && token_at(compiler->tokens, pos).kind != CALLS
+            && token_at(compiler->tokens, pos).kind != FNCTN
+            && token_at(compiler->tokens, pos).kind != BEG) {
             pos--;
         }
         pos++;
 
-        while (compiler->tokens->toks[pos].kind != THEN && compiler->tokens->toks[pos].kind != SEMICOLON && compiler->tokens->toks[pos].kind != CALLS) {
-            if (compiler->tokens->toks[pos].kind == CATCH && compiler->tokens->toks[pos+1].kind == ERROR) return;
+        while (token_at(compiler->tokens, pos).kind != THEN && token_at(compiler->tokens, pos).kind != SEMICOLON && token_at(compiler->tokens, pos).kind != CALLS) {
+            if (token_at(compiler->tokens, pos).kind == CATCH && token_at(compiler->tokens, pos+1).kind == ERROR) return;
             pos++;
         }
 
+        print_position(compiler);
 #ifdef PLEA_DEBUG
         fprintf(stderr, "Expected %s, got %s\n", token_to_string(token_kind), token_to_string(cur_token(compiler).kind));
 #else
@@ -135,19 +179,20 @@ Token get_and_expect_token(Compiler *compiler, Token_Kind token_kind) {
     compiler->pos++;
     if (cur_token(compiler).kind != token_kind) {
         int pos = compiler->pos-1;
-        while (compiler->tokens->toks[pos].kind != THEN
-            && compiler->tokens->toks[pos].kind != CALLS
-            && compiler->tokens->toks[pos].kind != FNCTN
-            && compiler->tokens->toks[pos].kind != BEG) {
+        while (token_at(compiler->tokens, pos).kind != THEN
+            && token_at(compiler->tokens, pos).kind != CALLS
+            && token_at(compiler->tokens, pos).kind != FNCTN
+            && token_at(compiler->tokens, pos).kind != BEG) {
             pos--;
         }
         pos++;
 
-        while (compiler->tokens->toks[pos].kind != THEN && compiler->tokens->toks[pos].kind != SEMICOLON && compiler->tokens->toks[pos].kind != CALLS) {
-            if (compiler->tokens->toks[pos].kind == CATCH && compiler->tokens->toks[pos+1].kind == ERROR) return (Token){ .kind = NONE, .val.int_val = 0 };
+        while (token_at(compiler->tokens, pos).kind != THEN && token_at(compiler->tokens, pos).kind != SEMICOLON && token_at(compiler->tokens, pos).kind != CALLS) {
+            if (token_at(compiler->tokens, pos).kind == CATCH && token_at(compiler->tokens, pos+1).kind == ERROR) return (Token){ .kind = NONE, .val.int_val = 0 };
             pos++;
         }
 
+        print_position(compiler);
 #ifdef PLEA_DEBUG
         fprintf(stderr, "Expected %s, got %s\n", token_to_string(token_kind), token_to_string(cur_token(compiler).kind));
 #else
@@ -160,21 +205,255 @@ Token get_and_expect_token(Compiler *compiler, Token_Kind token_kind) {
 
 int find_var(Compiler *compiler, char *name) {
     if (compiler->cur_function->vars_count == 0) return -1;
-    for (int i = 0; i < compiler->cur_function->vars_count; i++) {
+    for (int i = compiler->var_base; i < compiler->cur_function->vars_count; i++) {
         if (strcmp(name, compiler->cur_function->vars[i].name) == 0) return i;
     }
     return -1;
 }
 
+int is_reassigned(Compiler *compiler, char *name) {
+    for (unsigned i = compiler->function_pos; token_at(compiler->tokens, i).kind != SEMICOLON && token_at(compiler->tokens, i).kind != T_EOF; i++) {
+        if (token_at(compiler->tokens, i).kind == CHG
+            && token_at(compiler->tokens, i+1).kind == IDENT
+            && strcmp(token_at(compiler->tokens, i+1).val.ident_name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Whether the function registers a promise, a when without catch error.
+ * A tail call checks the caller's promises before the callee runs rather
+ * than after, so a function that has one keeps its ordinary calls. */
+int has_promise(Compiler *compiler) {
+    Token_List *toks = compiler->tokens;
+    for (unsigned i = compiler->function_pos; token_at(toks, i).kind != SEMICOLON && token_at(toks, i).kind != T_EOF; i++) {
+        if (token_at(toks, i).kind != WHEN) continue;
+        unsigned pos = i+3;
+        if (token_at(toks, pos).kind == NOT) pos++;
+        if (token_at(toks, pos+1).kind != CATCH || token_at(toks, pos+2).kind != ERROR) return 1;
+    }
+    return 0;
+}
+
+uint8_t index_op(Compiler *compiler, int var_index, Op_Code op) {
+    Array_Kind kind = compiler->cur_function->vars[var_index].array_kind;
+    if (kind == ARRAY_UNKNOWN) return op;
+
+    int is_char = kind == ARRAY_CHAR;
+    switch (op) {
+    case OP_PUSH_INDEX: return is_char ? OP_PUSH_INDEX_C : OP_PUSH_INDEX_I;
+    case OP_SET_INDEX:  return is_char ? OP_SET_INDEX_C : OP_SET_INDEX_I;
+    case OP_SETP_INDEX: return is_char ? OP_SETP_INDEX_C : OP_SETP_INDEX_I;
+    default: return op;
+    }
+}
+
+int match_var(Compiler *compiler, int *pos, int want_array) {
+    Token token = token_at(compiler->tokens, *pos);
+    if (token.kind != IDENT) return -1;
+
+    int var_index = find_var(compiler, token.val.ident_name);
+    if (var_index == -1) return -1;
+    int type = compiler->cur_function->vars[var_index].type;
+    if (want_array ? (type != 2 && type != 3) : (type != 0 && type != 1)) return -1;
+
+    (*pos)++;
+    return var_index;
+}
+
+int match_token(Compiler *compiler, int *pos, Token_Kind kind) {
+    if (token_at(compiler->tokens, *pos).kind != kind) return 0;
+    (*pos)++;
+    return 1;
+}
+
+int match_indexed(Compiler *compiler, int *pos, int *iv) {
+    int array = match_var(compiler, pos, 1);
+    if (array == -1 || !match_token(compiler, pos, AT)) return -1;
+
+    int index = match_var(compiler, pos, 0);
+    if (index == -1 || compiler->cur_function->vars[index].type != 0 || (*iv != -1 && index != *iv)) return -1;
+    *iv = index;
+    return array;
+}
+
+/* Recognizes a counted loop body of the form
+ *     let a@i = <const, var or b@i> then ... chg i,*+ then jmp _-...
+ * or a compare loop loading two arrays into scalars and leaving with
+ * `jmp ... when x is not y`, and emits an OP_BULK in front of it. At run
+ * time OP_BULK finds the `when` guarding i, runs the whole range in one go
+ * and leaves i at the guard value, so the guard fires exactly as it would
+ * after the last iteration. Anything it can't prove falls through to the
+ * element-wise code. */
+void compile_bulk_loop(Compiler *compiler) {
+    uint8_t descs[3*32];
+    int fill_vals[32];
+    int count = 0;
+    int entries = 0;
+    int iv = -1;
+    int loads = 0;
+    int compares = 0;
+    int pos = compiler->pos;
+
+    for (; ;) {
+        int start = pos;
+        if (count == 32) return;
+
+        if (match_token(compiler, &pos, LET)) {
+            int dst = match_indexed(compiler, &pos, &iv);
+            if (dst == -1 || !match_token(compiler, &pos, EQUALS)) return;
+
+            Token val = token_at(compiler->tokens, pos);
+            if (val.kind == INTEGER || val.kind == REAL) {
+                pos++;
+                descs[count*3] = BULK_FILL_IMM;
+                fill_vals[count] = val.val.int_val;
+            }
+            else if (token_at(compiler->tokens, pos+1).kind == AT) {
+                int src = match_indexed(compiler, &pos, &iv);
+                if (src == -1) return;
+                descs[count*3] = BULK_COPY;
+                descs[count*3+2] = src;
+            }
+            else {
+                int var = match_var(compiler, &pos, 0);
+                if (var == -1 || var == iv) return;
+                descs[count*3] = BULK_FILL_VAR;
+                descs[count*3+2] = var;
+            }
+            descs[count*3+1] = dst;
+            entries++;
+        }
+        else if (match_token(compiler, &pos, CHG)) {
+            int var = match_var(compiler, &pos, 0);
+            if (var == -1 || !match_token(compiler, &pos, COMMA)) return;
+
+            if (match_token(compiler, &pos, STAR)) {
+                if (var != iv) return;
+                int step = token_at(compiler->tokens, pos).kind;
+                if (!match_token(compiler, &pos, PLUS) && !match_token(compiler, &pos, MINUS)) return;
+                if (!match_token(compiler, &pos, THEN)) return;
+
+                if (!match_token(compiler, &pos, JMP) || !match_token(compiler, &pos, UNDER)) return;
+                int back = 0;
+                while (match_token(compiler, &pos, MINUS)) back++;
+                if (back != entries + 1) return;
+                if (token_at(compiler->tokens, pos).kind != THEN && token_at(compiler->tokens, pos).kind != SEMICOLON) return;
+                if (count == 0 || (loads && (!compares || count != 3))) return;
+
+                for (int i = 0; i < count; i++) {
+                    if (descs[i*3] != BULK_FILL_IMM) continue;
+                    if (fill_vals[i] >= 0 && fill_vals[i] < 256) {
+                        descs[i*3+2] = fill_vals[i];
+                        continue;
+                    }
+                    if (compiler->code->constant_list->count >= 256) return;
+                    descs[i*3] = BULK_FILL_CONST;
+                    descs[i*3+2] = compiler->code->constant_list->count;
+                    add_constant(compiler->code->constant_list, fill_vals[i]);
+                }
+
+                add_bytes(compiler->code, 4, OP_BULK, iv, step == MINUS, count);
+                for (int i = 0; i < count*3; i++) {
+                    da_append(compiler->code, descs[i], bytes);
+                }
+                return;
+            }
+
+            int src = match_indexed(compiler, &pos, &iv);
+            if (src == -1 || var == iv || loads == 2 || count != loads) return;
+            descs[count*3] = BULK_LOAD;
+            descs[count*3+1] = var;
+            descs[count*3+2] = src;
+            loads++;
+            entries++;
+        }
+        else if (match_token(compiler, &pos, JMP)) {
+            if (loads != 2 || compares) return;
+            if (!match_token(compiler, &pos, UNDER) || !match_token(compiler, &pos, PLUS)) return;
+            while (match_token(compiler, &pos, PLUS));
+            if (!match_token(compiler, &pos, WHEN)) return;
+
+            int lhs = match_var(compiler, &pos, 0);
+            if (!match_token(compiler, &pos, IS) || !match_token(compiler, &pos, NOT)) return;
+            int rhs = match_var(compiler, &pos, 0);
+            if (lhs != descs[1] || rhs != descs[4] || compiler->cur_function->vars[lhs].type != 0) return;
+            if (match_token(compiler, &pos, CATCH) && !match_token(compiler, &pos, ERROR)) return;
+
+            descs[count*3] = BULK_UNTIL_NE;
+            descs[count*3+1] = lhs;
+            descs[count*3+2] = rhs;
+            compares++;
+            entries += 2;
+        }
+        else {
+            return;
+        }
+
+        if (pos == start || !match_token(compiler, &pos, THEN)) return;
+        count++;
+    }
+}
+
+/* A return expression ends at the nm after it, not at the body's first then */
 int check_for_when(Compiler* compiler) {
-    for (unsigned i = compiler->pos; i < compiler->tokens->count; i++) {
-        Token token = compiler->tokens->toks[i];
+    for (unsigned i = compiler->pos; ; i++) {
+        Token token = token_at(compiler->tokens, i);
         if (token.kind == WHEN) return 1;
-        if (token.kind == THEN || token.kind == SEMICOLON) break;
+        if (token.kind == THEN || token.kind == SEMICOLON || token.kind == NM || token.kind == T_EOF) break;
     }
     return 0;
 }
 
+/* Pushes a float literal; 0.0 is the only one whose bits fit PUSHI */
+void compile_real(Compiler *compiler, float val) {
+    if ((Value32){ .real = val }.integer == 0) {
+        add_bytes(compiler->code, 2, OP_PUSHI, 0);
+    }
+    else {
+        add_bytes(compiler->code, 2, OP_CONST, compiler->code->constant_list->count);
+        add_real_constant(compiler->code->constant_list, val);
+    }
+}
+
+float literal_real(Token token) {
+    return token.kind == REAL ? token.val.real_val : (float)token.val.int_val;
+}
+
+int is_real_operand(Compiler *compiler, Token token) {
+    if (token.kind == REAL) return 1;
+    if (token.kind != IDENT) return 0;
+    int var_index = find_var(compiler, token.val.ident_name);
+    return var_index != -1 && compiler->cur_function->vars[var_index].type == 1;
+}
+
+/* Pushes one side of a when: a variable slot, marked in mode by var_bit,
+ * or a literal. Whens on floats compare floats, so an integer literal
+ * there is pushed as its float and an int variable doesn't fit. */
+void compile_when_operand(Compiler *compiler, Token token, int *mode, int var_bit) {
+    switch (token.kind) {
+    case IDENT: {
+        int var_index = find_var(compiler, token.val.ident_name);
+        if (var_index == -1) error(compiler, "Variable not found", __LINE__);
+        if ((*mode & WHEN_REAL) && compiler->cur_function->vars[var_index].type != 1) {
+            error(compiler, "Incompatible type", __LINE__);
+        }
+        *mode |= var_bit;
+        add_bytes(compiler->code, 2, OP_PUSHI, var_index);
+        break;
+    }
+    case REAL:
+    case INTEGER:
+        if (*mode & WHEN_REAL) {
+            compile_real(compiler, literal_real(token));
+        }
+        else {
+            add_bytes(compiler->code, 2, OP_PUSHI, token.val.int_val);
+        }
+        break;
+    default: error(compiler, "MALFORMED TOKEN", __LINE__);
+    }
+}
+
 void compile_when_condition(Compiler* compiler, int cur_byte_pos) {
     consume_token(compiler);
     int cond;
@@ -193,41 +472,12 @@ void compile_when_condition(Compiler* compiler, int cur_byte_pos) {
 
     Token rhs = consume_token(compiler);
 
-    int mode = 0;
-    switch (lhs.kind) {
-    case IDENT:
-        mode |= 1;
-        int var_index = find_var(compiler, lhs.val.ident_name);
-        if (var_index != -1) {
-            add_bytes(compiler->code, 2, OP_PUSHI, var_index);
-        }
-        else {
-            error(compiler, "Variable not found", __LINE__);
-        }
-        break;
-    case REAL:
-    case INTEGER: add_bytes(compiler->code, 2, OP_PUSHI, lhs.val.int_val); break;
-    default: error(compiler, "MALFORMED TOKEN", __LINE__);
-    }
-
-    switch (rhs.kind) {
-    case IDENT:
-        mode |= 2;
-        int var_index = find_var(compiler, rhs.val.ident_name);
-        if (var_index != -1) {
-            add_bytes(compiler->code, 2, OP_PUSHI, var_index);
-        }
-        else {
-            error(compiler, "Variable not found", __LINE__);
-        }
-        break;
-    case REAL:
-    case INTEGER: add_bytes(compiler->code, 2, OP_PUSHI, rhs.val.int_val); break;
-    default: error(compiler, "MALFORMED TOKEN", __LINE__);
-    }
+    int mode = is_real_operand(compiler, lhs) || is_real_operand(compiler, rhs) ? WHEN_REAL : 0;
+    compile_when_operand(compiler, lhs, &mode, 1);
+    compile_when_operand(compiler, rhs, &mode, 2);
     add_bytes(compiler->code, 2, OP_PUSHI, mode);
 
-    if (peek_token(compiler).kind == CATCH && compiler->tokens->toks[compiler->pos+2].kind == ERROR) {
+    if (peek_token(compiler).kind == CATCH && token_at(compiler->tokens, compiler->pos+2).kind == ERROR) {
         da_append(compiler->code, cond ? OP_WHEN : OP_WHEN_NOT, bytes);
         compiler->pos += 2;
     }
@@ -235,13 +485,89 @@ void compile_when_condition(Compiler* compiler, int cur_byte_pos) {
         da_append(compiler->code, cond ? OP_PROMISE : OP_PROMISE_NOT, bytes);
     }
 
-    if (cur_byte_pos >= 256) {
+    int target = compiler->byte_base + cur_byte_pos;
+    if (target >= 256) {
         add_bytes(compiler->code, 2, OP_JMPBSC, compiler->code->constant_list->count);
-        add_constant(compiler->code->constant_list, cur_byte_pos);
+        add_constant(compiler->code->constant_list, target);
+    }
+    else {
+        add_bytes(compiler->code, 2, OP_JMPBSI, target);
+    }
+}
+
+/* 1 or 0 when the `when` about to be compiled is decided at compile time,
+ * -1 when it has to be registered. A promise that can never be kept is left
+ * to fail at run time. */
+int static_when(Compiler *compiler) {
+    if (compiler->opt_level == 0) return -1;
+
+    Token_List *toks = compiler->tokens;
+    int pos = compiler->pos+2;
+    Token lhs = token_at(toks, pos++);
+    if (token_at(toks, pos++).kind != IS) return -1;
+    int cond = token_at(toks, pos).kind != NOT;
+    if (!cond) pos++;
+    Token rhs = token_at(toks, pos++);
+    int is_promise = !(token_at(toks, pos).kind == CATCH && token_at(toks, pos+1).kind == ERROR);
+
+    int equal;
+    if ((lhs.kind == INTEGER || lhs.kind == REAL) && (rhs.kind == INTEGER || rhs.kind == REAL)) {
+        equal = lhs.kind == REAL || rhs.kind == REAL
+            ? literal_real(lhs) == literal_real(rhs)
+            : lhs.val.int_val == rhs.val.int_val;
+    }
+    else if (lhs.kind == IDENT && rhs.kind == IDENT) {
+        /* A float isn't always equal to itself */
+        int var_index = find_var(compiler, lhs.val.ident_name);
+        if (var_index == -1 || var_index != find_var(compiler, rhs.val.ident_name)) return -1;
+        if (compiler->cur_function->vars[var_index].type == 1) return -1;
+        equal = 1;
     }
     else {
-        add_bytes(compiler->code, 2, OP_JMPBSI, cur_byte_pos);
+        return -1;
+    }
+
+    if (equal != cond && is_promise) return -1;
+    return equal == cond;
+}
+
+/* Compiles the `when` ending a statement whose code starts at cur_byte_pos,
+ * behind the 4-byte jump that skips it. A statically decided when drops
+ * that jump and either keeps the statement inline or removes it; the extra
+ * line position is kept either way so line-relative jumps stay put. */
+void compile_when(Compiler *compiler, int cur_byte_pos) {
+    Code *code = compiler->code;
+    int start = cur_byte_pos - 4;
+    int fold = static_when(compiler);
+
+    if (fold == -1 || code->line_positions->positions[code->line_positions->count-1] > start) {
+        da_append(code->line_positions, code->count+1, positions);
+        compile_when_condition(compiler, cur_byte_pos);
+        return;
+    }
+
+    int len = fold ? (int)code->count - cur_byte_pos : 0;
+    memmove(&code->bytes[start], &code->bytes[cur_byte_pos], len);
+    code->count = start + len;
+    da_append(code->line_positions, start, positions);
+
+    compiler->pos += 3;
+    if (peek_token(compiler).kind == NOT) consume_token(compiler);
+    consume_token(compiler);
+    if (peek_token(compiler).kind == CATCH && token_at(compiler->tokens, compiler->pos+2).kind == ERROR) compiler->pos += 2;
+}
+
+/* Token count of a return expression that can be compiled straight into a
+ * caller, or -1 if it registers whens, runs lines or calls itself. */
+int inline_size(Compiler *compiler, int start, int end, char *name) {
+    for (int i = start; i < end; i++) {
+        Token token = token_at(compiler->tokens, i);
+        if (token.kind == WHEN || token.kind == THEN || token.kind == RETURN) return -1;
+        if (token.kind == CALL
+            && token_at(compiler->tokens, i+1).kind == IDENT
+            && strcmp(token_at(compiler->tokens, i+1).val.ident_name, name) == 0) return -1;
     }
+    return end - start;
 }
 
 int compile_function_declaration(Compiler *compiler) {
@@ -252,20 +578,23 @@ int compile_function_declaration(Compiler *compiler) {
     while (peek_token(compiler).kind != NM) consume_token(compiler);
 
     expect_token(compiler, NM);
-    char *name = compiler->tokens->toks[compiler->pos+1].val.ident_name;
+    int nm_pos = compiler->pos;
+    char *name = token_at(compiler->tokens, compiler->pos+1).val.ident_name;
 
     da_append(compiler->code, OP_FNCTN, bytes);
     add_string(compiler->code, name);
 
     add_function(compiler->code->function_list, name, (int)compiler->code->count);
     compiler->cur_function = &compiler->code->function_list->functions[compiler->code->function_list->count - 1];
+    if (!compiler->declared) compiler->function_index = (int)compiler->code->function_list->count - 1;
+    compiler->function_pos = ret_val_pos;
     consume_token(compiler);
 
     expect_token(compiler, ARGS);
     while (peek_token(compiler).kind != CALLS) {
         expect_token(compiler, LET);
 
-        char *parameter_name = plea_strdup(consume_token(compiler).val.ident_name);
+        char *parameter_name = plea_strdup(SITE_VARS, consume_token(compiler).val.ident_name);
         compiler->cur_function->arity++;
 
         expect_token(compiler, IN);
@@ -282,6 +611,7 @@ int compile_function_declaration(Compiler *compiler) {
                 expect_token(compiler, R_BRACKET);
             }
             add_bytes(compiler->code, 2, OP_POP, compiler->cur_function->vars_count++);
+            compiler->cur_function->stack_args++;
         }
         else {
             compiler->cur_function->vars[compiler->cur_function->vars_count] = (Var){ .name = parameter_name, .type = 4 };
@@ -290,13 +620,41 @@ int compile_function_declaration(Compiler *compiler) {
     }
     consume_token(compiler);
     if (peek_token(compiler).kind == CATCH) compiler->pos += 3;
+
+    compiler->cur_function->ret_val_pos = ret_val_pos;
+    if (peek_token(compiler).kind == SEMICOLON) {
+        compiler->cur_function->inline_tokens = inline_size(compiler, ret_val_pos, nm_pos, name);
+    }
     return ret_val_pos;
 }
 
 int compile_expr(Compiler *compiler);
 
+void compile_offset(Compiler *compiler, int delta, int type) {
+    if (type == 1) {
+        if (delta == 1 || delta == -1) {
+            da_append(compiler->code, delta == 1 ? OP_INC_F : OP_DEC_F, bytes);
+        }
+        else if (delta != 0) {
+            compile_real(compiler, (float)delta);
+            da_append(compiler->code, OP_ADD_F, bytes);
+        }
+    }
+    else if (delta == 1 || delta == -1) {
+        da_append(compiler->code, delta == 1 ? OP_INC : OP_DEC, bytes);
+    }
+    else if (delta > -256 && delta < 256 && delta != 0) {
+        add_bytes(compiler->code, 3, OP_PUSHI, delta > 0 ? delta : -delta, delta > 0 ? OP_ADD : OP_SUB);
+    }
+    else if (delta != 0) {
+        add_bytes(compiler->code, 3, OP_CONST, compiler->code->constant_list->count, OP_ADD);
+        add_constant(compiler->code->constant_list, delta);
+    }
+}
+
 void compile_chg_expr(Compiler *compiler, int var_id) {
     Token cur_token = consume_token(compiler);
+    int type = compiler->cur_function->vars[var_id].type;
 
     if (cur_token.kind == STAR) {
         add_bytes(compiler->code, 2, OP_PUSH, var_id);
@@ -314,30 +672,34 @@ void compile_chg_expr(Compiler *compiler, int var_id) {
         return;
     }
 
+    /* The chain is folded into one constant offset: `+`/`-` step it by one
+     * and `.xn` repeats the last step n times in total. `-.xvar` keeps the
+     * x-1 - (var+1) of the step-by-step code. */
+    int delta = 0;
+    int step = 0;
     while (peek_token(compiler).kind == PLUS || peek_token(compiler).kind == MINUS || peek_token(compiler).kind == TIMES) {
         switch (peek_token(compiler).kind) {
-        case PLUS:  da_append(compiler->code, OP_INC, bytes); break;
-        case MINUS: da_append(compiler->code, OP_DEC, bytes); break;
+        case PLUS:  delta++; step = 1;  break;
+        case MINUS: delta--; step = -1; break;
         case TIMES:
             consume_token(compiler);
-
-            uint8_t cur_instruction = compiler->code->bytes[compiler->code->count-1];
-            if (cur_instruction != OP_INC && cur_instruction != OP_DEC) error(compiler, "MALFORMED TOKEN", __LINE__);
+            if (!step) error(compiler, "MALFORMED TOKEN", __LINE__);
 
             if (peek_token(compiler).kind == INTEGER || peek_token(compiler).kind == REAL) {
                 int val = peek_token(compiler).val.int_val;
-                if (val >= 256 || val < 0) {
-                    add_bytes(compiler->code, 3, OP_CONST, compiler->code->constant_list->count, cur_instruction == OP_INC ? OP_ADD : OP_SUB);
-                    add_constant(compiler->code->constant_list, val-1);
-                }
-                else {
-                    add_bytes(compiler->code, 3, OP_PUSHI, val-1, cur_instruction == OP_INC ? OP_ADD : OP_SUB);
-                }
+                delta += step * (val >= 256 || val < 0 ? val-1 : (uint8_t)(val-1));
             }
             else if (peek_token(compiler).kind == IDENT) {
                 int var_index = find_var(compiler, peek_token(compiler).val.ident_name);
                 if (var_index != -1) {
-                    add_bytes(compiler->code, 4, OP_PUSH, var_index, cur_instruction == OP_INC ? OP_DEC : OP_INC, cur_instruction == OP_INC ? OP_ADD : OP_SUB);
+                    if (compiler->cur_function->vars[var_index].type != type) error(compiler, "Incompatible type", __LINE__);
+                    if (type == 1) {
+                        add_bytes(compiler->code, 3, OP_PUSH, var_index, step == 1 ? OP_ADD_F : OP_SUB_F);
+                    }
+                    else {
+                        add_bytes(compiler->code, 3, OP_PUSH, var_index, step == 1 ? OP_ADD : OP_SUB);
+                    }
+                    delta--;
                 }
                 else {
                     error(compiler, "Variable not found", __LINE__);
@@ -346,22 +708,24 @@ void compile_chg_expr(Compiler *compiler, int var_id) {
             else {
                 error(compiler, "MALFORMED TOKEN", __LINE__);
             }
+            step = 0;
             break;
         default: error(compiler, "Unreachable", __LINE__);
         }
         consume_token(compiler);
     }
+    compile_offset(compiler, delta, type);
     add_bytes(compiler->code, 2, OP_POP, var_id);
 }
 
 int compile_let(Compiler *compiler, int in_expr) {
-    int cur_byte_pos;
+    int cur_byte_pos = 0;
     int var_index = find_var(compiler, peek_token(compiler).val.ident_name);
 
     int var_type = 0;
     if (peek_token(compiler).kind == LNG) {
         if (check_for_when(compiler)) {
-            add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+            add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
             cur_byte_pos = (int)compiler->code->count;
         }
         consume_token(compiler);
@@ -376,9 +740,9 @@ int compile_let(Compiler *compiler, int in_expr) {
         var_type = compile_expr(compiler);
         add_bytes(compiler->code, 3, OP_PUSHI, var_index, in_expr ? OP_SETP_LEN : OP_SET_LEN);
     }
-    else if (compiler->tokens->toks[compiler->pos+2].kind == AT) {
+    else if (token_at(compiler->tokens, compiler->pos+2).kind == AT) {
         if (check_for_when(compiler)) {
-            add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+            add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
             cur_byte_pos = (int)compiler->code->count;
         }
 
@@ -394,11 +758,11 @@ int compile_let(Compiler *compiler, int in_expr) {
         consume_token(compiler);
         if (compiler->cur_function->vars[var_index].type-2 != compile_expr(compiler)) error(compiler, "Incompatible type", __LINE__);
         var_type = compiler->cur_function->vars[var_index].type-2;
-        da_append(compiler->code, in_expr ? OP_SETP_INDEX : OP_SET_INDEX, bytes);
+        da_append(compiler->code, index_op(compiler, var_index, in_expr ? OP_SETP_INDEX : OP_SET_INDEX), bytes);
     }
     else if (var_index != -1 && compiler->cur_function->vars[var_index].type > 1) {
         if (check_for_when(compiler)) {
-            add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+            add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
             cur_byte_pos = (int)compiler->code->count;
         }
         consume_token(compiler);
@@ -408,28 +772,30 @@ int compile_let(Compiler *compiler, int in_expr) {
         consume_token(compiler);
         if (compiler->cur_function->vars[var_index].type-2 != compile_expr(compiler)) error(compiler, "Incompatible type", __LINE__);
         var_type = compiler->cur_function->vars[var_index].type-2;
-        da_append(compiler->code, in_expr ? OP_SETP_INDEX : OP_SET_INDEX, bytes);
+        da_append(compiler->code, index_op(compiler, var_index, in_expr ? OP_SETP_INDEX : OP_SET_INDEX), bytes);
     }
     else {
         if (check_for_when(compiler)) {
             add_bytes(compiler->code, 3, OP_SET_VAR, compiler->cur_function->vars_count, 0);
-            add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+            add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
             cur_byte_pos = (int)compiler->code->count;
         }
-        compiler->cur_function->vars[compiler->cur_function->vars_count] = (Var){ .name = plea_strdup(consume_token(compiler).val.ident_name), .type = 0 };
+        compiler->cur_function->vars[compiler->cur_function->vars_count] = (Var){ .name = plea_strdup(SITE_VARS, consume_token(compiler).val.ident_name), .type = 0 };
         expect_token(compiler, EQUALS);
 
         int var_id = compiler->cur_function->vars_count;
         int type = peek_token(compiler).kind;
         if (type == INTEGER || type == REAL) {
-            int val = consume_token(compiler).val.int_val;
+            Token literal = consume_token(compiler);
+            int val = literal.val.int_val;
 
             if (val < 256 && val >= 0) {
                 add_bytes(compiler->code, 3, OP_SET_VAR, compiler->cur_function->vars_count, val);
             }
             else {
                 add_bytes(compiler->code, 4, OP_CONST, compiler->code->constant_list->count, OP_POP, compiler->cur_function->vars_count);
-                add_constant(compiler->code->constant_list, val);
+                if (type == REAL) add_real_constant(compiler->code->constant_list, literal.val.real_val);
+                else add_constant(compiler->code->constant_list, val);
             }
             compiler->cur_function->vars[compiler->cur_function->vars_count].type = type - 22;
             compiler->cur_function->vars_count++;
@@ -439,8 +805,12 @@ int compile_let(Compiler *compiler, int in_expr) {
             if (peek_token(compiler).kind == L_BRACKET) {
                 consume_token(compiler);
                 expect_token(compiler, R_BRACKET);
-                add_bytes(compiler->code, 2, OP_SET_ARRAY, compiler->cur_function->vars_count);
-                compiler->cur_function->vars[compiler->cur_function->vars_count].type = ((type - 13) >> 1) + 2;
+
+                Var *var = &compiler->cur_function->vars[compiler->cur_function->vars_count];
+                Array_Kind kind = type == SH_CHAR ? ARRAY_CHAR : type == SH_FLOAT ? ARRAY_FLOAT : ARRAY_INT;
+                add_bytes(compiler->code, 3, OP_SET_ARRAY, compiler->cur_function->vars_count, kind);
+                var->type = ((type - 13) >> 1) + 2;
+                if (!is_reassigned(compiler, var->name)) var->array_kind = kind;
             }
             else {
                 add_bytes(compiler->code, 3, OP_SET_VAR, compiler->cur_function->vars_count, 0);
@@ -458,19 +828,16 @@ int compile_let(Compiler *compiler, int in_expr) {
         var_type = compiler->cur_function->vars[compiler->cur_function->vars_count-1].type;
     }
 
-    if (peek_token(compiler).kind == WHEN) {
-        da_append(compiler->code->line_positions, compiler->code->count+1, positions);
-        compile_when_condition(compiler, cur_byte_pos);
-    }
+    if (peek_token(compiler).kind == WHEN) compile_when(compiler, cur_byte_pos);
     if (peek_token(compiler).kind == CATCH) compiler->pos += 2;
 
     return var_type;
 }
 
 int compile_chg(Compiler *compiler) {
-    int cur_byte_pos;
+    int cur_byte_pos = 0;
     if (check_for_when(compiler)) {
-        add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+        add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
         cur_byte_pos = (int)compiler->code->count;
     }
 
@@ -485,51 +852,112 @@ int compile_chg(Compiler *compiler) {
             error(compiler, "Incompatible type", __LINE__);
         }
 
-        int val = consume_token(compiler).val.int_val;
+        Token literal = consume_token(compiler);
+        int val = literal.val.int_val;
         if (val < 256 && val >= 0) {
             add_bytes(compiler->code, 3, OP_SET_VAR, var_index, val);
         }
         else {
             add_bytes(compiler->code, 4, OP_CONST, compiler->code->constant_list->count, OP_POP, var_index);
-            add_constant(compiler->code->constant_list, val);
+            if (literal.kind == REAL) add_real_constant(compiler->code->constant_list, literal.val.real_val);
+            else add_constant(compiler->code->constant_list, val);
         }
     }
     else {
         compile_chg_expr(compiler, var_index);
     }
 
-    if (peek_token(compiler).kind == WHEN) {
-        da_append(compiler->code->line_positions, compiler->code->count+1, positions);
-        compile_when_condition(compiler, cur_byte_pos);
-    }
+    if (peek_token(compiler).kind == WHEN) compile_when(compiler, cur_byte_pos);
     if (peek_token(compiler).kind == CATCH) compiler->pos += 2;
     return var_index;
 }
 
-int compile_function_call(Compiler *compiler) {
-    int type = 0;
-    char *function_name = plea_strdup(cur_token(compiler).val.ident_name);
-    expect_token(compiler, IN);
+int can_inline(Compiler *compiler, Function *callee) {
+    int limit = compiler->opt_level >= 2 ? 4*INLINE_MAX_TOKENS : compiler->opt_level == 1 ? INLINE_MAX_TOKENS : 0;
+    return callee != compiler->cur_function
+        && callee->inline_tokens != -1
+        && callee->inline_tokens <= limit
+        && compiler->cur_function->vars_count + callee->vars_count < 256;
+}
 
-    int cur_byte_pos;
-    if (check_for_when(compiler)) {
-        add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
-        cur_byte_pos = (int)compiler->code->count;
+/* Binds the arguments to fresh slots in the caller's frame, in the same
+ * order as the callee's prologue, and compiles the callee's return
+ * expression there with lookups confined to those slots. */
+int compile_inline_call(Compiler *compiler, Function *callee, int is_tail) {
+    int base = compiler->cur_function->vars_count;
+    for (int i = 0; i < callee->arity; i++) {
+        compiler->cur_function->vars[base+i] = callee->vars[i];
+        compiler->cur_function->vars[base+i].name = plea_strdup(SITE_VARS, callee->vars[i].name);
+        if (callee->vars[i].type != 4) add_bytes(compiler->code, 2, OP_POP, base+i);
     }
+    compiler->cur_function->vars_count += callee->arity;
+
+    int pos = compiler->pos;
+    int var_base = compiler->var_base;
+    int function_pos = compiler->function_pos;
+
+    compiler->pos = callee->ret_val_pos;
+    compiler->var_base = base;
+    compiler->function_pos = callee->ret_val_pos;
+    compiler->in_tail_position = is_tail;
+    compile_expr(compiler);
+
+    compiler->pos = pos;
+    compiler->var_base = var_base;
+    compiler->function_pos = function_pos;
+    return callee->return_type;
+}
+
+/* Index of the first function called name declared so far */
+unsigned lookup_function(Compiler *compiler, char *name) {
+    Function_List *function_list = compiler->declared ? compiler->declared : compiler->code->function_list;
+    unsigned count = compiler->declared ? (unsigned)compiler->function_index+1 : function_list->count;
 
     unsigned function;
-    for (function = 0; function < compiler->code->function_list->count; function++) {
-        if (strcmp(function_name, compiler->code->function_list->functions[function].name) == 0) break;
-        if (function == compiler->code->function_list->count - 1 && strcmp(function_name, "print") != 0) {
+    for (function = 0; function < count; function++) {
+        if (strcmp(name, function_list->functions[function].name) == 0) break;
+        if (function == count - 1 && strcmp(name, "print") != 0) {
             error(compiler, "Function not found", __LINE__);
         }
     }
+    return function;
+}
+
+void wait_for_function(Compile_Pool *pool, unsigned index);
+
+/* A parallel compile builds the current function in its own list and
+ * reads the others from the declared ones once they're published */
+Function *function_at(Compiler *compiler, unsigned index) {
+    if ((int)index == compiler->function_index) return compiler->cur_function;
+    if (!compiler->declared) return &compiler->code->function_list->functions[index];
+    if (compiler->pool && (int)index < compiler->function_index) wait_for_function(compiler->pool, index);
+    return &compiler->declared->functions[index];
+}
+
+int compile_function_call(Compiler *compiler, int is_tail) {
+    int type = 0;
+    int is_statement = compiler->in_statement;
+    compiler->in_statement = 0;
+    char *function_name = plea_strdup(SITE_FUNCTIONS, cur_token(compiler).val.ident_name);
+    expect_token(compiler, IN);
+
+    int cur_byte_pos = 0;
+    int call_pos = -1;
+    if (check_for_when(compiler)) {
+        is_tail = 0;
+        add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+        cur_byte_pos = (int)compiler->code->count;
+    }
+
+    int is_print = strcmp(function_name, "print") == 0;
+    unsigned function = lookup_function(compiler, function_name);
+    Function *callee = is_print ? NULL : function_at(compiler, function);
 
     int arguments = 0;
     for (; ;) {
         arguments++;
         if (peek_token(compiler).kind == IDENT && strcmp(peek_token(compiler).val.ident_name, "input") == 0) {
-            if (strcmp(function_name, "print") != 0 && compiler->code->function_list->functions[function].vars[arguments-1].type != 2) {
+            if (!is_print && callee->vars[arguments-1].type != 2) {
                 error(compiler, "Argument has wrong type", __LINE__);
             }
             da_append(compiler->code, OP_INPUT, bytes);
@@ -538,58 +966,78 @@ int compile_function_call(Compiler *compiler) {
         else if (peek_token(compiler).kind != VOID) {
             consume_token(compiler);
             type = compile_expr(compiler);
-            if (strcmp(function_name, "print") == 0) {
+            if (is_print) {
                 if (type != 2 && type != 0) error(compiler, "Argument has wrong type", __LINE__);
             }
-            else if (compiler->code->function_list->functions[function].vars[arguments-1].type != type) {
+            else if (callee->vars[arguments-1].type != type) {
                 error(compiler, "Argument has wrong type", __LINE__);
             }
         }
         else {
-            if (strcmp(function_name, "print") == 0 || compiler->code->function_list->functions[function].vars[arguments-1].type != 4) {
+            if (is_print || callee->vars[arguments-1].type != 4) {
                 error(compiler, "Argument has wrong type", __LINE__);
             }
             consume_token(compiler);
         }
         if (peek_token(compiler).kind != COMMA) {
-            da_append(compiler->code, OP_CALL, bytes);
-            add_string(compiler->code, function_name);
             if (cur_token(compiler).kind == ENDIN) break;
             expect_token(compiler, ENDIN);
             break;
         }
         consume_token(compiler);
     }
-    if (strcmp(function_name, "print") != 0) {
-        type = compiler->code->function_list->functions[function].return_type;
+    if (!is_print) {
+        type = callee->return_type;
     }
 
-    if (strcmp(function_name, "print") == 0) {
+    if (is_print) {
         if (arguments != 1) error(compiler, "Function call has wrong amount of arguments", __LINE__);
     }
-    else if (compiler->code->function_list->functions[function].arity != arguments) {
+    else if (callee->arity != arguments) {
         error(compiler, "Function call has wrong amount of arguments", __LINE__);
     }
 
-    if (peek_token(compiler).kind == WHEN) {
-        da_append(compiler->code->line_positions, compiler->code->count+1, positions);
-        compile_when_condition(compiler, cur_byte_pos);
+    if (!is_print
+        && peek_token(compiler).kind != WHEN
+        && can_inline(compiler, callee)) {
+        type = compile_inline_call(compiler, callee, is_tail);
+    }
+    else {
+        call_pos = (int)compiler->code->count;
+        da_append(compiler->code, OP_CALL, bytes);
+        add_string(compiler->code, function_name);
+
+        if (compiler->analysis && !compiler->analysis->dead && !is_print) {
+            Edge call = { .from = compiler->function_index, .to = function };
+            da_append(&compiler->analysis->calls, call, edges);
+        }
     }
+
+    if (is_tail && call_pos != -1 && !is_print && peek_token(compiler).kind != WHEN) {
+        compiler->code->bytes[call_pos] = OP_TAILCALL;
+    }
+    /* Inside the body a when runs, so a fired call drops its result too */
+    if (is_statement) da_append(compiler->code, OP_DROP, bytes);
+
+    if (peek_token(compiler).kind == WHEN) compile_when(compiler, cur_byte_pos);
     if (peek_token(compiler).kind == CATCH) compiler->pos += 2;
 
+    plea_free(function_name);
     return type;
 }
 
 void compile_line(Compiler *compiler);
 
-int compile_call(Compiler *compiler) {
+int compile_call(Compiler *compiler, int is_tail) {
     int type = 0;
 
     consume_token(compiler);
     if (peek_token(compiler).kind == IN) {
-        type = compile_function_call(compiler);
+        type = compile_function_call(compiler, is_tail);
         return type;
     }
+    int is_statement = compiler->in_statement;
+    compiler->in_statement = 0;
 
     while (cur_token(compiler).kind != RETURN) {
         compile_line(compiler);
@@ -601,21 +1049,19 @@ int compile_call(Compiler *compiler) {
         type = 4;
     else
         type = compile_expr(compiler);
+    if (is_statement && type != 4) da_append(compiler->code, OP_DROP, bytes);
     return type;
 }
 
 int compile_expr(Compiler *compiler) {
     int type = 0;
+    int is_tail = compiler->in_tail_position;
+    compiler->in_tail_position = 0;
+
     switch (cur_token(compiler).kind) {
     case REAL:
         type = 1;
-        if (cur_token(compiler).val.int_val < 256 && cur_token(compiler).val.int_val >= 0) {
-            add_bytes(compiler->code, 2, OP_PUSHI, cur_token(compiler).val.int_val);
-        }
-        else {
-            add_bytes(compiler->code, 2, OP_CONST, compiler->code->constant_list->count);
-            add_constant(compiler->code->constant_list, cur_token(compiler).val.int_val);
-        }
+        compile_real(compiler, cur_token(compiler).val.real_val);
         break;
     case INTEGER:
         type = 0;
@@ -636,7 +1082,7 @@ int compile_expr(Compiler *compiler) {
             compiler->pos += 2;
             add_bytes(compiler->code, 2, OP_PUSHI, var_index);
             compile_expr(compiler);
-            da_append(compiler->code, OP_PUSH_INDEX, bytes);
+            da_append(compiler->code, index_op(compiler, var_index, OP_PUSH_INDEX), bytes);
         }
         else if (compiler->cur_function->vars[var_index].type > 1 && peek_token(compiler).kind == L_BRACKET) {
             type = compiler->cur_function->vars[var_index].type;
@@ -646,7 +1092,7 @@ int compile_expr(Compiler *compiler) {
         }
         else if (compiler->cur_function->vars[var_index].type > 1) {
             type = compiler->cur_function->vars[var_index].type - 2;
-            add_bytes(compiler->code, 5, OP_PUSHI, var_index, OP_PUSHI, 0, OP_PUSH_INDEX);
+            add_bytes(compiler->code, 5, OP_PUSHI, var_index, OP_PUSHI, 0, index_op(compiler, var_index, OP_PUSH_INDEX));
         }
         else {
             type = compiler->cur_function->vars[var_index].type;
@@ -665,8 +1111,8 @@ int compile_expr(Compiler *compiler) {
     }
     case CALL: {
         int cur_var_count = compiler->cur_function->vars_count;
-        type = compile_call(compiler);
-        compiler->cur_function->vars_count = cur_var_count;
+        type = compile_call(compiler, is_tail);
+        drop_vars(compiler->cur_function, cur_var_count);
         break;
     }
     default: error(compiler, "Invalid expression", __LINE__);
@@ -674,82 +1120,126 @@ int compile_expr(Compiler *compiler) {
     return type;
 }
 
-void compile_jump(Compiler *compiler) {
-    int cur_line = (int)compiler->code->line_positions->count-1;
+int compile_jump(Compiler *compiler) {
+    int cur_line = compiler->line_base + (int)compiler->code->line_positions->count-1;
 
-    int cur_byte_pos;
+    int cur_byte_pos = 0;
     if (check_for_when(compiler)) {
-        add_bytes(compiler->code, 4, OP_PUSHI, compiler->code->line_positions->count-1, OP_INC, OP_JMP);
+        add_bytes(compiler->code, 4, OP_PUSHI, compiler->line_base + compiler->code->line_positions->count-1, OP_INC, OP_JMP);
         cur_byte_pos = (int)compiler->code->count;
     }
 
     expect_token(compiler, UNDER);
-    if (cur_line >= 256 || cur_line < 0) {
+    int target = cur_line;
+    while (peek_token(compiler).kind == PLUS || peek_token(compiler).kind == MINUS) {
+        target += peek_token(compiler).kind == PLUS ? 1 : -1;
+        consume_token(compiler);
+    }
+
+    if (target >= 256 || target < 0) {
         add_bytes(compiler->code, 2, OP_CONST, compiler->code->constant_list->count);
-        add_constant(compiler->code->constant_list, cur_line);
+        add_constant(compiler->code->constant_list, target);
     }
     else {
-        add_bytes(compiler->code, 2, OP_PUSHI, cur_line);
+        add_bytes(compiler->code, 2, OP_PUSHI, target);
     }
 
-    while (peek_token(compiler).kind == PLUS || peek_token(compiler).kind == MINUS) {
-        if (peek_token(compiler).kind == PLUS) {
-            da_append(compiler->code, OP_INC, bytes);
-        }
-        else if (peek_token(compiler).kind == MINUS) {
-            da_append(compiler->code, OP_DEC, bytes);
-        }
-        consume_token(compiler);
+    if (compiler->analysis && !compiler->analysis->dead) {
+        Edge jump = { .from = compiler->analysis->line, .to = target };
+        da_append(&compiler->analysis->jumps, jump, edges);
     }
 
+    int unconditional = 1;
     if (peek_token(compiler).kind == WHEN) {
-        add_bytes(compiler->code, 2, OP_POPR, OP_JMP);
-        da_append(compiler->code->line_positions, compiler->code->count+1, positions);
-        compile_when_condition(compiler, cur_byte_pos);
+        unconditional = static_when(compiler) == 1;
+        if (!unconditional) da_append(compiler->code, OP_POPR, bytes);
+        da_append(compiler->code, OP_JMP, bytes);
+        compile_when(compiler, cur_byte_pos);
     }
     else {
         da_append(compiler->code, OP_JMP, bytes);
     }
     if (peek_token(compiler).kind == CATCH) compiler->pos += 2;
+    return unconditional;
 }
 
-void init_compiler(Token_List *tokens, Compiler *compiler) {
-    Code *code = malloc(sizeof(Code));
+void init_compiler(Token_List *tokens, Compiler *compiler, int opt_level, Analysis *analysis) {
+    Code *code = plea_alloc(SITE_CODE, sizeof(Code));
     code->count = 0;
     code->capacity = 4;
-    code->bytes = malloc(4 * sizeof(uint8_t));
+    code->bytes = plea_alloc(SITE_CODE, 4 * sizeof(uint8_t));
 
-    code->function_list = malloc(sizeof(Function_List));
+    code->function_list = plea_alloc(SITE_FUNCTIONS, sizeof(Function_List));
     code->function_list->count = 0;
     code->function_list->capacity = 4;
-    code->function_list->functions = malloc(4 * sizeof(Function));
+    code->function_list->functions = plea_alloc(SITE_FUNCTIONS, 4 * sizeof(Function));
 
-    code->constant_list = malloc(sizeof(Constant_List));
+    code->constant_list = plea_alloc(SITE_CONSTANTS, sizeof(Constant_List));
     code->constant_list->count = 0;
     code->constant_list->capacity = 4;
-    code->constant_list->constants = malloc(4 * sizeof(Value));
+    code->constant_list->constants = plea_alloc(SITE_CONSTANTS, 4 * sizeof(Value));
 
-    code->line_positions = malloc(sizeof(Line_Pos_List));
+    code->line_positions = plea_alloc(SITE_LINES, sizeof(Line_Pos_List));
     code->line_positions->count = 0;
     code->line_positions->capacity = 4;
-    code->line_positions->positions = malloc(4 * sizeof(int));
+    code->line_positions->positions = plea_alloc(SITE_LINES, 4 * sizeof(int));
+
+    code->source_lines = plea_calloc(SITE_LINES, 1, sizeof(Line_Pos_List));
+    code->line_table = plea_calloc(SITE_LINES, 1, sizeof(Line_Table));
 
     *compiler = (Compiler){
         .code = code,
         .tokens = tokens,
+        .analysis = analysis,
         .pos = 0,
         .is_in_function = 0,
+        .in_tail_position = 0,
+        .in_statement = 0,
         .cur_function = NULL,
+        .declared = NULL,
+        .pool = NULL,
+        .function_index = -1,
+        .line_base = 0,
+        .byte_base = 0,
+        .function_pos = 0,
+        .var_base = 0,
+        .opt_level = opt_level,
         .ret_val_pos = 0,
     };
 }
 
+/* Gives the line positions up to entries without one the source line */
+void mark_source_lines(Code *code, size_t entries, int line) {
+    while (code->source_lines->count < entries) {
+        da_append(code->source_lines, line, positions);
+    }
+}
+
+int is_main_mark(Compiler *compiler) {
+    Token_List *toks = compiler->tokens;
+    return strcmp(compiler->cur_function->name, "main") == 0
+        && token_at(toks, compiler->pos-1).kind == CALLS
+        && token_at(toks, compiler->pos+1).kind == IDENT
+        && strcmp(token_at(toks, compiler->pos+1).val.ident_name, "main") == 0;
+}
+
 void compile_line(Compiler *compiler) {
-    switch (cur_token(compiler).kind) {
+    Token_Kind kind = cur_token(compiler).kind;
+    int source_line, source_col;
+    /* The return expression is compiled at the ; but written after returns */
+    Token source = kind == SEMICOLON ? token_at(compiler->tokens, compiler->ret_val_pos) : cur_token(compiler);
+    token_position(compiler->tokens, source, &source_line, &source_col);
+    int line_start = (int)compiler->code->count;
+    size_t entries = compiler->code->line_positions->count;
+    int jumps = 0;
+    mark_source_lines(compiler->code, entries, source_line);
+
+    switch (kind) {
     case SEMICOLON: {
         int cur_position = compiler->pos;
 
         compiler->pos = compiler->ret_val_pos;
+        compiler->in_tail_position = !has_promise(compiler);
         compiler->cur_function->return_type = compile_expr(compiler);
         da_append(compiler->code, OP_RET, bytes);
         compiler->pos = cur_position;
@@ -761,48 +1251,79 @@ void compile_line(Compiler *compiler) {
         compiler->ret_val_pos = compile_function_declaration(compiler);
         break;
     case LET:
+        compile_bulk_loop(compiler);
         compile_let(compiler, 0);
         if (peek_token(compiler).kind != SEMICOLON) expect_token(compiler, THEN);
         break;
     case CHG:
+        compile_bulk_loop(compiler);
         compile_chg(compiler);
         if (peek_token(compiler).kind != SEMICOLON) expect_token(compiler, THEN);
         break;
     case CALL: {
+        /* Nothing reads a statement's result, so it is dropped and loops
+         * run in constant stack. main's first statement only marks it and
+         * is skipped on entry, so it has none to drop. */
+        compiler->in_statement = !is_main_mark(compiler);
         int cur_var_count = compiler->cur_function->vars_count;
-        compile_call(compiler);
-        compiler->cur_function->vars_count = cur_var_count;
+        compile_call(compiler, 0);
+        drop_vars(compiler->cur_function, cur_var_count);
 
         if (peek_token(compiler).kind != SEMICOLON) expect_token(compiler, THEN);
         break;
     }
     case JMP:
-        compile_jump(compiler);
+        jumps = compile_jump(compiler);
         if (peek_token(compiler).kind != SEMICOLON) expect_token(compiler, THEN);
         break;
     default: error(compiler, "MALFORMED TOKEN", __LINE__);
     }
     da_append(compiler->code->line_positions, compiler->code->count, positions);
+    mark_source_lines(compiler->code, compiler->code->line_positions->count-1, source_line);
+
+    Analysis *analysis = compiler->analysis;
+    if (!analysis) return;
+
+    if (!analysis->dead) {
+        Line_Info line = {
+            .start = (int)entries-1,
+            .function = compiler->function_index,
+            .kind = kind,
+            .jumps = jumps,
+        };
+        da_append(&analysis->lines, line, lines);
+    }
+    else if (analysis->dead[analysis->line]) {
+        compiler->code->count = line_start;
+        for (size_t i = entries; i < compiler->code->line_positions->count; i++) {
+            compiler->code->line_positions->positions[i] = line_start;
+        }
+        if (kind == FNCTN) compiler->cur_function->location = line_start;
+    }
+    analysis->line++;
 }
 
-Code *compile(Token_List *tokens) {
-    Compiler compiler;
-    init_compiler(tokens, &compiler);
-
-    if (tokens->toks[0].kind == BEG) {
-        da_append(compiler.code, OP_BEG, bytes);
-        consume_token(&compiler);
-        add_string(compiler.code, tokens->toks[1].val.ident_name);
-        expect_token(&compiler, SEMICOLON);
+void compile_header(Compiler *compiler) {
+    if (token_at(compiler->tokens, 0).kind == BEG) {
+        da_append(compiler->code, OP_BEG, bytes);
+        consume_token(compiler);
+        add_string(compiler->code, token_at(compiler->tokens, 1).val.ident_name);
+        expect_token(compiler, SEMICOLON);
     }
 
-    da_append(compiler.code, OP_CALL, bytes);
-    add_string(compiler.code, "main");
-    da_append(compiler.code, OP_HLT, bytes);
+    da_append(compiler->code, OP_CALL, bytes);
+    add_string(compiler->code, "main");
+    da_append(compiler->code, OP_HLT, bytes);
 
-    da_append(compiler.code->line_positions, compiler.code->count, positions);
+    da_append(compiler->code->line_positions, compiler->code->count, positions);
+}
 
-    Token token = compiler.tokens->toks[compiler.pos];
+Code *compile_pass(Token_List *tokens, int opt_level, Analysis *analysis) {
+    Compiler compiler;
+    init_compiler(tokens, &compiler, opt_level, analysis);
+    compile_header(&compiler);
+
+    Token token = token_at(compiler.tokens, compiler.pos);
     while (token.kind != T_EOF) {
         if (compiler.is_in_function) {
             compile_line(&compiler);
@@ -815,9 +1336,1077 @@ Code *compile(Token_List *tokens) {
             token = consume_token(&compiler);
         }
     }
-    for (unsigned i = 0; i < compiler.code->function_list->count; i++) {
-        free(compiler.code->function_list->functions[i].vars);
-    }
     compiler.code->line_positions->count--;
     return compiler.code;
 }
+
+/* Marks the lines a second compile can drop: everything in functions main
+ * never reaches through calls or jumps, and lines only reachable by falling
+ * through an unconditional jump that nothing else jumps to. Function
+ * headers and returns of reached functions are always kept. */
+void find_dead_lines(Analysis *analysis, Code *code) {
+    size_t lines = analysis->lines.count;
+    Line_Info *line = analysis->lines.lines;
+    int functions = (int)code->function_list->count;
+    int entries = (int)code->line_positions->count+1;
+
+    int *line_of = plea_alloc(SITE_PASSES, entries * sizeof(int));
+    for (size_t i = 0; i < lines; i++) {
+        int end = i+1 < lines ? line[i+1].start : entries;
+        for (int e = line[i].start; e < end; e++) line_of[e] = (int)i;
+    }
+
+    uint8_t *reached = plea_calloc(SITE_PASSES, functions, 1);
+    for (int i = 0; i < functions; i++) {
+        if (strcmp(code->function_list->functions[i].name, "main") == 0) {
+            reached[i] = 1;
+            break;
+        }
+    }
+
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (size_t i = 0; i < analysis->calls.count; i++) {
+            Edge call = analysis->calls.edges[i];
+            if (reached[call.from] && !reached[call.to]) reached[call.to] = changed = 1;
+        }
+        for (size_t i = 0; i < analysis->jumps.count; i++) {
+            Edge jump = analysis->jumps.edges[i];
+            if (jump.to < 0 || jump.to >= entries) continue;
+
+            int to = line[line_of[jump.to]].function;
+            if (reached[line[jump.from].function] && !reached[to]) reached[to] = changed = 1;
+        }
+    }
+
+    uint8_t *targeted = plea_calloc(SITE_PASSES, lines, 1);
+    for (size_t i = 0; i < analysis->jumps.count; i++) {
+        Edge jump = analysis->jumps.edges[i];
+        if (jump.to >= 0 && jump.to < entries && reached[line[jump.from].function]) {
+            targeted[line_of[jump.to]] = 1;
+        }
+    }
+
+    analysis->dead = plea_calloc(SITE_ANALYSIS, lines, 1);
+    for (size_t i = 0; i < lines; i++) {
+        if (!reached[line[i].function]) {
+            analysis->dead[i] = 1;
+        }
+        else if (i > 0 && line[i].kind != FNCTN && line[i].kind != SEMICOLON && !targeted[i]) {
+            analysis->dead[i] = analysis->dead[i-1] || line[i-1].jumps;
+        }
+    }
+
+    plea_free(targeted);
+    plea_free(reached);
+    plea_free(line_of);
+}
+
+/* Bytes taken by the instruction at pos, or 0 when it runs past the end of
+ * the code */
+int instruction_length(Code *code, int pos) {
+    int left = (int)code->count - pos;
+    int length;
+    switch (code->bytes[pos]) {
+    case OP_SET_VAR:
+    case OP_SET_ARRAY: length = 3; break;
+    case OP_CONST:
+    case OP_PUSH:
+    case OP_PUSHI:
+    case OP_POP:
+    case OP_JMPBSI:
+    case OP_JMPBSC: length = 2; break;
+    case OP_BULK: length = left < 4 ? 4 : 4 + 3*code->bytes[pos+3]; break;
+    case OP_CALL:
+    case OP_TAILCALL:
+    case OP_FNCTN:
+    case OP_BEG: {
+        uint8_t *end = left > 1 ? memchr(&code->bytes[pos+1], 0, left-1) : NULL;
+        if (end == NULL) return 0;
+        length = (int)(end - &code->bytes[pos]) + 1;
+        break;
+    }
+    default: length = 1; break;
+    }
+    return length <= left ? length : 0;
+}
+
+/* Follows the PUSHI/CONST/INC chain that feeds a jump its line */
+void track_known(Code *code, int pos, int *known, int *has_known) {
+    switch (code->bytes[pos]) {
+    case OP_PUSHI:
+        *known = code->bytes[pos+1];
+        *has_known = 1;
+        break;
+    case OP_CONST:
+        *known = value_as_int(code->constant_list->constants[code->bytes[pos+1]]);
+        *has_known = 1;
+        break;
+    case OP_INC: (*known)++; break;
+    case OP_DEC: (*known)--; break;
+    case OP_POPR: break;
+    default: *has_known = 0; break;
+    }
+}
+
+/* The scalar slot an instruction stores to, or -1 */
+int written_slot(Code *code, int pos) {
+    switch (code->bytes[pos]) {
+    case OP_POP:
+    case OP_SET_VAR:
+    case OP_SET_ARRAY: return code->bytes[pos+1];
+    case OP_INPUT: return 255;
+    default: return -1;
+    }
+}
+
+int is_pure(uint8_t op) {
+    return op == OP_PUSHI || op == OP_CONST || op == OP_INC || op == OP_DEC || op == OP_PUSH;
+}
+
+/* Every static jump as an edge from its position to its target, JMPBSIs
+ * included. Returns 0 if some jump can't be followed statically. */
+int collect_jumps(Code *code, Edge_List *jumps) {
+    int known = 0;
+    int has_known = 0;
+    for (int pos = 0; pos < (int)code->count; pos += instruction_length(code, pos)) {
+        uint8_t op = code->bytes[pos];
+        if (op == OP_JMPB || op == OP_JMPS || op == OP_JMPBS) return 0;
+        if (op == OP_JMP) {
+            if (!has_known || known < 0 || (size_t)known >= code->line_positions->count) return 0;
+            da_append(jumps, ((Edge){pos, code->line_positions->positions[known]}), edges);
+        }
+        else if (op == OP_JMPBSI) {
+            da_append(jumps, ((Edge){pos, code->bytes[pos+1]}), edges);
+        }
+        else if (op == OP_JMPBSC) {
+            da_append(jumps, ((Edge){pos, value_as_int(code->constant_list->constants[code->bytes[pos+1]])}), edges);
+        }
+        track_known(code, pos, &known, &has_known);
+    }
+    return 1;
+}
+
+int references(Guarded_When *when, uint8_t *writes) {
+    return (when->slots[0] != -1 && writes[when->slots[0]]) || (when->slots[1] != -1 && writes[when->slots[1]]);
+}
+
+int shares_slot(Guarded_When *a, Guarded_When *b) {
+    for (int i = 0; i < 2; i++) {
+        if (a->slots[i] != -1 && (a->slots[i] == b->slots[0] || a->slots[i] == b->slots[1])) return 1;
+    }
+    return 0;
+}
+
+/* Finds the code a when can fire in. Skipped when bodies count as part of
+ * it; a jump behind the when kills its entry, anything leaving forward or
+ * out of main keeps it alive where it can't be followed. */
+void guard_when(Code *code, Guarded_When *when, Edge_List *jumps) {
+    int skipped_to = 0;
+    int furthest = 0;
+    int known = 0;
+    int has_known = 0;
+    int written = 0;
+    when->end = -1;
+
+    for (int pos = when->start; pos < (int)code->count; pos += instruction_length(code, pos)) {
+        uint8_t op = code->bytes[pos];
+        if (written && !is_pure(op) && op != OP_JMP) when->writes_last = 0;
+
+        int slot = written_slot(code, pos);
+        if (slot != -1) {
+            when->writes[slot] = 1;
+            if (slot == when->slots[0] || slot == when->slots[1]) written = 1;
+        }
+
+        switch (op) {
+        case OP_JMP: {
+            int target = code->line_positions->positions[known];
+            if (target > pos) {
+                if (pos >= skipped_to) skipped_to = target;
+                if (target > furthest) furthest = target;
+            }
+            else if (pos >= skipped_to && target <= when->start) {
+                when->end = pos;
+                when->closes_on_line = target == when->body - 4;
+                when->left_early = furthest > pos;
+                if (written && !when->closes_on_line) when->writes_last = 0;
+                for (size_t i = 0; i < jumps->count; i++) {
+                    Edge jump = jumps->edges[i];
+                    if ((jump.from < when->start || jump.from > pos) && jump.to >= when->start && jump.to <= pos) when->entered = 1;
+                }
+                return;
+            }
+            else if (written) {
+                when->writes_last = 0;
+            }
+            break;
+        }
+        case OP_CALL:
+            if (strcmp((char *)&code->bytes[pos+1], "print") != 0) when->left_early = 1;
+            break;
+        case OP_BULK: {
+            /* OP_BULK looks for the when guarding its loop in the queue */
+            uint8_t writes[256] = {0};
+            writes[code->bytes[pos+1]] = 1;
+            for (int d = 0; d < code->bytes[pos+3]; d++) {
+                uint8_t *desc = &code->bytes[pos+4+d*3];
+                if (desc[0] == BULK_LOAD) writes[desc[1]] = 1;
+            }
+            for (int i = 0; i < 256; i++) when->writes[i] |= writes[i];
+            if (references(when, writes)) when->bulk = 1;
+            if (when->bulk) when->writes_last = 0;
+            break;
+        }
+        case OP_RET:
+        case OP_TAILCALL:
+        case OP_HLT:
+        case OP_FNCTN:
+            return;
+        default: break;
+        }
+        track_known(code, pos, &known, &has_known);
+    }
+}
+
+int is_jump_body(Code *code, Guarded_When *when) {
+    int pos = when->body;
+    if (code->bytes[pos] != OP_PUSHI && code->bytes[pos] != OP_CONST) return 0;
+    pos += 2;
+    while (code->bytes[pos] == OP_INC || code->bytes[pos] == OP_DEC) pos++;
+    return code->bytes[pos] == OP_POPR && code->bytes[pos+1] == OP_JMP && pos+2 == when->pos-7;
+}
+
+/* Copies of a when's test after each write it has to be checked at. Every
+ * position behind an insertion moves: line positions, function bodies and
+ * the JMPBSI/JMPBSC targets. */
+void insert_tests(Code *code, int *test_at, int tests) {
+    int count = (int)code->count;
+    int *moved = plea_alloc(SITE_PASSES, (count+1) * sizeof(int));
+    uint8_t *bytes = plea_alloc(SITE_CODE, count + tests*9);
+    int n = 0;
+
+    for (int pos = 0; pos < count; ) {
+        int length = instruction_length(code, pos);
+        for (int k = 0; k < length; k++) moved[pos+k] = n+k;
+        memcpy(&bytes[n], &code->bytes[pos], length);
+        n += length;
+        if (test_at[pos] != -1) {
+            memcpy(&bytes[n], &code->bytes[test_at[pos]-6], 9);
+            n += 9;
+        }
+        pos += length;
+    }
+    moved[count] = n;
+
+    uint8_t *relocated = plea_calloc(SITE_PASSES, 256, 1);
+    for (int pos = 0; pos < n; pos += instruction_length(&(Code){ .count = n, .bytes = bytes }, pos)) {
+        if (bytes[pos] == OP_JMPBSI) {
+            int target = moved[bytes[pos+1]];
+            if (target < 256) {
+                bytes[pos+1] = target;
+            }
+            else {
+                bytes[pos] = OP_JMPBSC;
+                bytes[pos+1] = code->constant_list->count;
+                add_constant(code->constant_list, target);
+                relocated[bytes[pos+1]] = 1;
+            }
+        }
+        else if (bytes[pos] == OP_JMPBSC && !relocated[bytes[pos+1]]) {
+            Value *target = &code->constant_list->constants[bytes[pos+1]];
+            *target = value_int(moved[value_as_int(*target)]);
+            relocated[bytes[pos+1]] = 1;
+        }
+    }
+    for (size_t i = 0; i < code->line_positions->count; i++) {
+        code->line_positions->positions[i] = moved[code->line_positions->positions[i]];
+    }
+    for (size_t i = 0; i < code->function_list->count; i++) {
+        code->function_list->functions[i].location = moved[code->function_list->functions[i].location];
+    }
+
+    plea_free(code->bytes);
+    code->bytes = bytes;
+    code->count = n;
+    code->capacity = count + tests*9;
+    plea_free(relocated);
+    plea_free(moved);
+}
+
+/* Lowers whens in main that are only ever decided at known points, like
+ * loop guards, to OP_TEST: the condition is compared there and the JMPBSI
+ * into the statement runs or is skipped, without a queue entry polled
+ * after every instruction. A when whose statement jumps is tested where it
+ * is registered and after every write to its variables in the loop it
+ * guards; any other when only where it is registered, if its variables
+ * are written at most right before the jump back to its line. Whens that
+ * can't be shown to stay in their loop keep the queue. */
+void lower_static_whens(Code *code) {
+    int main_location = -1;
+    for (unsigned i = 0; i < code->function_list->count; i++) {
+        Function *function = &code->function_list->functions[i];
+        if (strcmp(function->name, "main") == 0) main_location = function->location;
+    }
+    if (main_location == -1) return;
+
+    /* Whens are only polled against the last called function, which has
+     * to lie in front of main for them to fire there at all */
+    for (unsigned i = 0; i < code->function_list->count; i++) {
+        if (code->function_list->functions[i].location > main_location) return;
+    }
+
+    Edge_List jumps = {0};
+    if (!collect_jumps(code, &jumps)) {
+        plea_free(jumps.edges);
+        return;
+    }
+
+    Guarded_When_List whens = {0};
+    for (int pos = main_location; pos < (int)code->count; pos += instruction_length(code, pos)) {
+        uint8_t op = code->bytes[pos];
+        if (op != OP_WHEN && op != OP_WHEN_NOT && op != OP_PROMISE && op != OP_PROMISE_NOT) continue;
+        /* Slots come from PUSHI, literals from PUSHI or CONST */
+        uint8_t mode = pos >= 7 ? code->bytes[pos-1] : 0;
+        if (pos < 7 || code->bytes[pos-2] != OP_PUSHI
+            || (code->bytes[pos-6] != OP_PUSHI && (mode & 1 || code->bytes[pos-6] != OP_CONST))
+            || (code->bytes[pos-4] != OP_PUSHI && (mode & 2 || code->bytes[pos-4] != OP_CONST))) {
+            plea_free(whens.whens);
+            plea_free(jumps.edges);
+            return;
+        }
+
+        Guarded_When when = {
+            .pos = pos,
+            .body = code->bytes[pos+1] == OP_JMPBSI
+                ? code->bytes[pos+2]
+                : value_as_int(code->constant_list->constants[code->bytes[pos+2]]),
+            .slots = { mode & 1 ? code->bytes[pos-5] : -1, mode & 2 ? code->bytes[pos-3] : -1 },
+            .start = pos+3,
+            .writes_last = 1,
+        };
+        guard_when(code, &when, &jumps);
+        when.jump_body = is_jump_body(code, &when);
+        when.confined = when.end != -1 && !when.left_early;
+        da_append(&whens, when, whens);
+    }
+
+    /* A when stays in its loop unless another one fires in there and
+     * jumps out. One whose statement lies in front of it kills it on the
+     * way; one confined to a loop elsewhere is dead by then. */
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (size_t i = 0; i < whens.count; i++) {
+            Guarded_When *when = &whens.whens[i];
+            if (!when->confined) continue;
+            for (size_t j = 0; j < whens.count; j++) {
+                Guarded_When *other = &whens.whens[j];
+                if (i == j || (other->pos >= when->start && other->pos <= when->end)) continue;
+                if (!references(other, when->writes) || other->body < when->pos) continue;
+                if (other->confined && (other->end < when->start || other->start > when->end)) continue;
+                when->confined = 0;
+                changed = 1;
+                break;
+            }
+        }
+    }
+
+    int *test_at = plea_alloc(SITE_PASSES, code->count * sizeof(int));
+    for (size_t i = 0; i < code->count; i++) test_at[i] = -1;
+    int tests = 0;
+    int room = 256 - (int)code->constant_list->count - (int)jumps.count;
+
+    for (size_t i = 0; i < whens.count; i++) {
+        Guarded_When *when = &whens.whens[i];
+        if (!when->confined) continue;
+
+        int tested = when->jump_body && !when->bulk && !when->entered;
+        for (size_t j = 0; j < whens.count && tested; j++) {
+            Guarded_When *inner = &whens.whens[j];
+            if (i != j && inner->pos >= when->start && inner->pos <= when->end && shares_slot(inner, when)) tested = 0;
+        }
+
+        if (tested) {
+            int sites = 0;
+            for (int pos = when->start; pos <= when->end; pos += instruction_length(code, pos)) {
+                int slot = written_slot(code, pos);
+                if (slot != -1 && (slot == when->slots[0] || slot == when->slots[1])) sites++;
+            }
+            if (tests + sites >= room) tested = 0;
+            for (int pos = when->start; pos <= when->end && tested; pos += instruction_length(code, pos)) {
+                int slot = written_slot(code, pos);
+                if (slot != -1 && (slot == when->slots[0] || slot == when->slots[1])) test_at[pos] = when->pos;
+            }
+            if (tested) tests += sites;
+        }
+        if (!tested && !when->writes_last) continue;
+
+        uint8_t op = code->bytes[when->pos];
+        int is_real = code->bytes[when->pos-1] & WHEN_REAL;
+        if (op == OP_WHEN || op == OP_PROMISE) {
+            code->bytes[when->pos] = is_real ? OP_TEST_F : OP_TEST;
+        }
+        else {
+            code->bytes[when->pos] = is_real ? OP_TEST_NOT_F : OP_TEST_NOT;
+        }
+    }
+
+    if (tests > 0) insert_tests(code, test_at, tests);
+
+    plea_free(test_at);
+    plea_free(whens.whens);
+    plea_free(jumps.edges);
+}
+
+void wait_for_function(Compile_Pool *pool, unsigned index) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->done[index]) pthread_cond_wait(&pool->published, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Finds each function the way compile_pass walks the tokens: from FNCTN
+ * to the first semicolon after it. 0 if one runs into the next. */
+int split_units(Compile_Pool *pool, int pos) {
+    Token_List *tokens = pool->tokens;
+    for (; token_at(tokens, pos).kind != T_EOF; pos++) {
+        if (token_at(tokens, pos).kind != FNCTN) continue;
+
+        int start = pos;
+        int nm = -1;
+        for (pos++; token_at(tokens, pos).kind != SEMICOLON && token_at(tokens, pos).kind != T_EOF; pos++) {
+            if (token_at(tokens, pos).kind == FNCTN) return 0;
+            if (token_at(tokens, pos).kind == NM && nm == -1 && pos >= start+3) nm = pos;
+        }
+        if (nm == -1 || token_at(tokens, nm+1).kind != IDENT) return 0;
+
+        Compile_Unit unit = {
+            .start = start,
+            .end = token_at(tokens, pos).kind == T_EOF ? pos-1 : pos,
+        };
+        da_append(pool, unit, units);
+
+        Function function = {
+            .name = plea_strdup(SITE_FUNCTIONS, token_at(tokens, nm+1).val.ident_name),
+            .inline_tokens = -1,
+            .max_depth = -1,
+        };
+        da_append(&pool->functions, function, functions);
+        if (token_at(tokens, pos).kind == T_EOF) break;
+    }
+    return pool->count > 0;
+}
+
+/* Code the cache holds is only lent to the unit */
+void free_unit_code(Compile_Unit *unit) {
+    if (!unit->code) return;
+    if (unit->cached) {
+        unit->code = NULL;
+        unit->cached = 0;
+        return;
+    }
+    free_code(unit->code);
+    unit->code = NULL;
+}
+
+uint32_t hash_bytes(uint32_t hash, const void *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= ((const uint8_t *)data)[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void copy_analysis(Analysis *to, Analysis *from) {
+    for (size_t i = 0; i < from->lines.count; i++) da_append(&to->lines, from->lines.lines[i], lines);
+    for (size_t i = 0; i < from->calls.count; i++) da_append(&to->calls, from->calls.edges[i], edges);
+    for (size_t i = 0; i < from->jumps.count; i++) da_append(&to->jumps, from->jumps.edges[i], edges);
+}
+
+void free_unit_round(Unit_Round *round) {
+    if (round->code) free_code(round->code);
+    plea_free(round->analysis.lines.lines);
+    plea_free(round->analysis.calls.edges);
+    plea_free(round->analysis.jumps.edges);
+    free_vars(round->function.vars, round->function.vars_count);
+}
+
+void free_unit_cache(Unit_Cache *cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        Cached_Unit *unit = &cache->units[i];
+        for (int r = 0; r < unit->rounds; r++) free_unit_round(&unit->round[r]);
+        plea_free(unit->name);
+    }
+    plea_free(cache->units);
+    cache->units = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+}
+
+/* Everything about a round of compile_unit that is not in the function's
+ * own source */
+Unit_Round unit_round_key(Compile_Pool *pool, size_t index) {
+    Compile_Unit *unit = &pool->units[index];
+    Unit_Round key = {
+        .publish = pool->publish,
+        .line_base = unit->line_base,
+        .byte_base = unit->byte_base,
+        .line_index = unit->line_index,
+    };
+    if (pool->analysis && pool->analysis->dead) {
+        key.dead_hash = hash_bytes(2166136261u, &pool->analysis->dead[unit->line_index], unit->lines);
+    }
+    return key;
+}
+
+Unit_Round *find_unit_round(Compile_Pool *pool, size_t index, Unit_Round *key) {
+    if (!pool->cache || pool->cache->units[index].hash != pool->units[index].hash) return NULL;
+
+    Cached_Unit *cached = &pool->cache->units[index];
+    for (int r = 0; r < cached->rounds; r++) {
+        Unit_Round *round = &cached->round[r];
+        if (round->publish == key->publish && round->line_base == key->line_base && round->byte_base == key->byte_base
+            && round->line_index == key->line_index && round->dead_hash == key->dead_hash) return round;
+    }
+    return NULL;
+}
+
+/* Installs a cached round as if the function had just been compiled. The
+ * code is lent, not copied; only its source lines move with the function. */
+void reuse_unit_round(Compile_Pool *pool, size_t index, Unit_Round *round) {
+    Compile_Unit *unit = &pool->units[index];
+    Cached_Unit *cached = &pool->cache->units[index];
+    int line_shift = pool->next_cache->units[index].source_line - cached->source_line;
+
+    Code *code = round->code;
+    for (size_t i = 0; i < code->source_lines->count; i++) code->source_lines->positions[i] += line_shift;
+    unit->code = code;
+    unit->cached = 1;
+    unit->bytes = round->bytes;
+    unit->entries = round->entries;
+    if (pool->analysis) {
+        unit->analysis = (Analysis){ .dead = pool->analysis->dead, .line = unit->line_index + round->lines };
+        copy_analysis(&unit->analysis, &round->analysis);
+        unit->lines = round->lines;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (round->diverged) pool->diverged = 1;
+    if (pool->publish) {
+        Function *declared = &pool->functions.functions[index];
+        char *name = declared->name;
+        *declared = round->function;
+        declared->name = name;
+        declared->ret_val_pos += unit->start;
+        declared->vars = copy_vars(round->function.vars, round->function.vars_count, 256);
+        pool->done[index] = 1;
+        pthread_cond_broadcast(&pool->published);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Keeps what this round made of the function for the next build: a round
+ * that was reused moves over from the last cache, otherwise the cache
+ * takes the unit's code. Each unit only touches its own entry, so no lock
+ * is needed. */
+void record_unit_round(Compile_Pool *pool, size_t index, Unit_Round *key, Unit_Round *reused) {
+    Compile_Unit *unit = &pool->units[index];
+    Cached_Unit *cached = &pool->next_cache->units[index];
+    if (cached->rounds == UNIT_ROUNDS) return;
+
+    Unit_Round *round = &cached->round[cached->rounds++];
+    if (reused) {
+        *round = *reused;
+        *reused = (Unit_Round){0};
+        return;
+    }
+
+    *round = *key;
+    round->bytes = unit->bytes;
+    round->entries = unit->entries;
+    round->lines = pool->analysis ? unit->lines : 0;
+    round->code = unit->code;
+    unit->cached = 1;
+    if (pool->analysis) copy_analysis(&round->analysis, &unit->analysis);
+
+    if (pool->publish) {
+        Function *declared = &pool->functions.functions[index];
+        round->function = *declared;
+        round->function.name = NULL;
+        round->function.ret_val_pos -= unit->start;
+        round->function.vars = NULL;
+        if (declared->vars && declared->vars_count > 0) {
+            round->function.vars = copy_vars(declared->vars, declared->vars_count, declared->vars_count);
+        }
+        else {
+            round->function.vars_count = 0;
+        }
+    }
+}
+
+/* Compiles one function at the bases the last round worked out. The
+ * first line position stands for the one the function starts at. */
+void compile_unit(Compile_Pool *pool, size_t index) {
+    Compile_Unit *unit = &pool->units[index];
+    Unit_Round key = unit_round_key(pool, index);
+    Unit_Round *cached = find_unit_round(pool, index, &key);
+    if (cached) {
+        reuse_unit_round(pool, index, cached);
+        record_unit_round(pool, index, &key, cached);
+        return;
+    }
+    unit->compiled = 1;
+
+    Compiler compiler;
+    init_compiler(pool->tokens, &compiler, pool->opt_level, NULL);
+    compiler.declared = &pool->functions;
+    compiler.pool = pool->publish ? pool : NULL;
+    compiler.function_index = (int)index;
+    compiler.line_base = unit->line_base;
+    compiler.byte_base = unit->byte_base;
+    compiler.pos = unit->start;
+    compiler.is_in_function = 1;
+    if (pool->analysis) {
+        unit->analysis = (Analysis){ .dead = pool->analysis->dead, .line = unit->line_index };
+        compiler.analysis = &unit->analysis;
+    }
+    da_append(compiler.code->line_positions, 0, positions);
+
+    Token token = token_at(compiler.tokens, compiler.pos);
+    while (compiler.is_in_function && token.kind != T_EOF) {
+        compile_line(&compiler);
+        token = consume_token(&compiler);
+    }
+
+    Code *code = compiler.code;
+    unit->code = code;
+    unit->bytes = (int)code->count;
+    unit->entries = (int)code->line_positions->count - 1;
+    if (pool->analysis) unit->lines = unit->analysis.line - unit->line_index;
+
+    int diverged = compiler.pos != unit->end + 1 || code->function_list->count != 1;
+    pthread_mutex_lock(&pool->lock);
+    if (diverged) pool->diverged = 1;
+    if (pool->publish) {
+        /* Everything but the name, which lookups read without the lock */
+        Function *declared = &pool->functions.functions[index];
+        Function *function = &code->function_list->functions[0];
+        if (code->function_list->count > 0) {
+            declared->location = function->location;
+            declared->arity = function->arity;
+            declared->stack_args = function->stack_args;
+            declared->vars = function->vars;
+            declared->vars_count = function->vars_count;
+            declared->return_type = function->return_type;
+            declared->ret_val_pos = function->ret_val_pos;
+            declared->inline_tokens = function->inline_tokens;
+            function->vars = NULL;
+        }
+        pool->done[index] = 1;
+        pthread_cond_broadcast(&pool->published);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    key.diverged = diverged;
+    if (pool->next_cache) record_unit_round(pool, index, &key, NULL);
+}
+
+void *compile_worker(void *arg) {
+    Compile_Pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (index >= pool->count) return NULL;
+        compile_unit(pool, index);
+    }
+}
+
+void compile_round(Compile_Pool *pool, int jobs) {
+    for (size_t i = 0; i < pool->count; i++) free_unit_code(&pool->units[i]);
+    pool->next = 0;
+
+    pthread_t *threads = plea_alloc(SITE_POOL, jobs * sizeof(pthread_t));
+    int started = 0;
+    while (started < jobs && pthread_create(&threads[started], NULL, compile_worker, pool) == 0) started++;
+    if (started == 0) compile_worker(pool);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    plea_free(threads);
+}
+
+/* Line positions and analysis lines of every unit in the joined code.
+ * Neither changes between rounds, unlike the byte counts. */
+void place_lines(Compile_Pool *pool) {
+    int line_base = 0;
+    int line_index = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        pool->units[i].line_base = line_base;
+        pool->units[i].line_index = line_index;
+        line_base += pool->units[i].entries;
+        line_index += pool->units[i].lines;
+    }
+}
+
+void place_bytes(Compile_Pool *pool, int byte_base) {
+    for (size_t i = 0; i < pool->count; i++) {
+        pool->units[i].byte_base = byte_base;
+        byte_base += pool->units[i].bytes;
+    }
+}
+
+/* Joins what the units recorded in the first round, as if one compile
+ * had run through them in order */
+void merge_analysis(Compile_Pool *pool, Analysis *analysis) {
+    for (size_t i = 0; i < pool->count; i++) {
+        Compile_Unit *unit = &pool->units[i];
+        for (size_t j = 0; j < unit->analysis.lines.count; j++) {
+            Line_Info line = unit->analysis.lines.lines[j];
+            line.start += unit->line_base;
+            da_append(&analysis->lines, line, lines);
+        }
+        for (size_t j = 0; j < unit->analysis.calls.count; j++) {
+            da_append(&analysis->calls, unit->analysis.calls.edges[j], edges);
+        }
+        for (size_t j = 0; j < unit->analysis.jumps.count; j++) {
+            Edge jump = unit->analysis.jumps.edges[j];
+            jump.from += unit->line_index;
+            jump.to += unit->line_base;
+            da_append(&analysis->jumps, jump, edges);
+        }
+        plea_free(unit->analysis.lines.lines);
+        plea_free(unit->analysis.calls.edges);
+        plea_free(unit->analysis.jumps.edges);
+    }
+}
+
+/* Moves the constant indices of a separately compiled function, linked in
+ * from pos on, behind the base of the pool it joined. Indices are bytes,
+ * so they wrap just as they would have in one compile. */
+void relocate_constants(Code *code, int pos, int base) {
+    for (int length; pos < (int)code->count; pos += length) {
+        length = instruction_length(code, pos);
+        if (length == 0) break;
+
+        uint8_t op = code->bytes[pos];
+        if (op == OP_CONST || op == OP_JMPBSC) {
+            code->bytes[pos+1] += base;
+        }
+        else if (op == OP_BULK) {
+            for (int d = 0; d < code->bytes[pos+3]; d++) {
+                uint8_t *desc = &code->bytes[pos+4+d*3];
+                if (desc[0] == BULK_FILL_CONST) desc[2] += base;
+            }
+        }
+    }
+}
+
+/* Appends the units to the header. 0 if one doesn't start where the
+ * sizes from the last round put it. */
+int link_units(Compile_Pool *pool, Code *code) {
+    for (size_t i = 0; i < pool->count; i++) {
+        Compile_Unit *unit = &pool->units[i];
+        Code *part = unit->code;
+        if ((int)code->count != unit->byte_base || (int)code->line_positions->count-1 != unit->line_base) return 0;
+
+        int constant_base = (int)code->constant_list->count;
+        for (size_t j = 0; j < part->count; j++) {
+            da_append(code, part->bytes[j], bytes);
+        }
+        relocate_constants(code, unit->byte_base, constant_base);
+        for (size_t j = 0; j < part->constant_list->count; j++) {
+            da_append(code->constant_list, part->constant_list->constants[j], constants);
+        }
+        for (size_t j = 1; j < part->line_positions->count; j++) {
+            da_append(code->line_positions, unit->byte_base + part->line_positions->positions[j], positions);
+        }
+        for (size_t j = 0; j < part->source_lines->count; j++) {
+            da_append(code->source_lines, part->source_lines->positions[j], positions);
+        }
+        pool->functions.functions[i].location = unit->byte_base + part->function_list->functions[0].location;
+    }
+    code->line_positions->count--;
+    return 1;
+}
+
+/* Hashes the source of every unit and starts the cache of this build. The
+ * last build's cache only applies to the same functions in the same order
+ * at the same optimisation level; otherwise it is dropped. */
+void start_unit_cache(Compile_Pool *pool, Unit_Cache *cache, Unit_Cache *next) {
+    Token_List *tokens = pool->tokens;
+    *next = (Unit_Cache){
+        .count = pool->count,
+        .capacity = pool->count,
+        .units = plea_calloc(SITE_POOL, pool->count, sizeof(Cached_Unit)),
+        .opt_level = pool->opt_level,
+    };
+
+    int matches = cache->count == pool->count && cache->opt_level == pool->opt_level;
+    for (size_t i = 0; i < pool->count; i++) {
+        Compile_Unit *unit = &pool->units[i];
+        Token first = token_at(tokens, unit->start);
+        Token last = token_at(tokens, unit->end);
+        size_t end = last.kind == SEMICOLON ? last.offset + 1 : token_at(tokens, unit->end + 1).offset;
+        unit->hash = hash_bytes(2166136261u, &tokens->lexer.src[first.offset], end - first.offset);
+
+        int col;
+        Cached_Unit *cached = &next->units[i];
+        cached->name = plea_strdup(SITE_POOL, pool->functions.functions[i].name);
+        cached->hash = unit->hash;
+        cached->start = unit->start;
+        token_position(tokens, first, &cached->source_line, &col);
+        if (matches && strcmp(cache->units[i].name, cached->name) != 0) matches = 0;
+    }
+
+    if (!matches) free_unit_cache(cache);
+    pool->cache = cache->count > 0 ? cache : NULL;
+    pool->next_cache = next;
+}
+
+/* Hashes each function's header and what the first round published of
+ * it. Other functions depend on nothing else, so if none of these changed
+ * the cached code of the others is still what they compile to. 0 if one
+ * changed while another was reused. */
+int check_interfaces(Compile_Pool *pool) {
+    Token_List *tokens = pool->tokens;
+    int changed = 0;
+    int reused = 0;
+
+    for (size_t i = 0; i < pool->count; i++) {
+        Compile_Unit *unit = &pool->units[i];
+        int calls = unit->start;
+        while (calls < unit->end && token_at(tokens, calls).kind != CALLS) calls++;
+        size_t start = token_at(tokens, unit->start).offset;
+        uint32_t hash = hash_bytes(2166136261u, &tokens->lexer.src[start], token_at(tokens, calls).offset - start);
+
+        Function *function = &pool->functions.functions[i];
+        int published[] = { function->arity, function->stack_args, function->return_type, function->inline_tokens,
+                            function->inline_tokens != -1 ? function->vars_count : 0 };
+        hash = hash_bytes(hash, published, sizeof(published));
+        for (int v = 0; function->vars && v < function->arity; v++) {
+            hash = hash_bytes(hash, &function->vars[v].type, sizeof(int));
+            hash = hash_bytes(hash, &function->vars[v].array_kind, sizeof(Array_Kind));
+        }
+        pool->next_cache->units[i].interface = hash;
+
+        if (!pool->cache) continue;
+        if (pool->cache->units[i].interface != hash) changed = 1;
+        if (!unit->compiled) reused = 1;
+    }
+    return !(changed && reused);
+}
+
+/* Compiles the functions on jobs threads and links them into one Code.
+ * Every round knows the function signatures, so a function compiles the
+ * same as in one pass; a second and third round redo them with the line
+ * and byte bases the rounds before worked out. NULL if the source doesn't
+ * split cleanly into functions.
+ *
+ * With a cache, functions the last build compiled the same way are
+ * reused, and the cache is replaced with this build's. If that turns out
+ * to be unsafe the cache is emptied and NULL returned. */
+Code *compile_parallel(Token_List *tokens, int opt_level, int jobs, Unit_Cache *cache) {
+    token_at(tokens, (size_t)-1);
+
+    Compiler header;
+    init_compiler(tokens, &header, opt_level, NULL);
+    compile_header(&header);
+
+    Compile_Pool pool = {
+        .tokens = tokens,
+        .opt_level = opt_level,
+    };
+    Analysis analysis = {0};
+    Unit_Cache next = {0};
+    Code *code = NULL;
+
+    if (split_units(&pool, header.pos)) {
+        if (cache) start_unit_cache(&pool, cache, &next);
+        pool.done = plea_calloc(SITE_POOL, pool.count, 1);
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.published, NULL);
+        if ((size_t)jobs > pool.count) jobs = (int)pool.count;
+
+        pool.analysis = opt_level > 0 ? &analysis : NULL;
+        pool.publish = 1;
+        compile_round(&pool, jobs);
+        pool.publish = 0;
+        if (cache && !check_interfaces(&pool)) pool.diverged = 1;
+        place_lines(&pool);
+
+        if (opt_level > 0) merge_analysis(&pool, &analysis);
+        if (opt_level > 0 && !pool.diverged) {
+            int entries = 1;
+            for (size_t i = 0; i < pool.count; i++) entries += pool.units[i].entries;
+            Line_Pos_List line_positions = { .count = entries-1 };
+            find_dead_lines(&analysis, &(Code){ .function_list = &pool.functions, .line_positions = &line_positions });
+            compile_round(&pool, jobs);
+        }
+
+        if (!pool.diverged) {
+            place_bytes(&pool, (int)header.code->count);
+            compile_round(&pool, jobs);
+        }
+        if (!pool.diverged && link_units(&pool, header.code)) code = header.code;
+
+        for (size_t i = 0; i < pool.count; i++) free_unit_code(&pool.units[i]);
+        pthread_cond_destroy(&pool.published);
+        pthread_mutex_destroy(&pool.lock);
+    }
+
+    if (code) {
+        plea_free(code->function_list->functions);
+        *code->function_list = pool.functions;
+    }
+    else {
+        for (size_t i = 0; i < pool.functions.count; i++) {
+            plea_free(pool.functions.functions[i].name);
+            free_vars(pool.functions.functions[i].vars, pool.functions.functions[i].vars_count);
+        }
+        plea_free(pool.functions.functions);
+        free_code(header.code);
+    }
+    if (cache) {
+        free_unit_cache(cache);
+        if (code) {
+            next.compiled = 0;
+            for (size_t i = 0; i < pool.count; i++) next.compiled += pool.units[i].compiled;
+            *cache = next;
+        }
+        else {
+            free_unit_cache(&next);
+        }
+    }
+    plea_free(pool.units);
+    plea_free(pool.done);
+    plea_free(analysis.lines.lines);
+    plea_free(analysis.calls.edges);
+    plea_free(analysis.jumps.edges);
+    plea_free(analysis.dead);
+    return code;
+}
+
+void add_leb128(Line_Table *table, unsigned value) {
+    while (value >= 0x80) {
+        da_append(table, (uint8_t)(value | 0x80), deltas);
+        value >>= 7;
+    }
+    da_append(table, (uint8_t)value, deltas);
+}
+
+unsigned read_leb128(Line_Table *table, size_t *pos) {
+    unsigned value = 0;
+    for (int shift = 0; *pos < table->count; shift += 7) {
+        uint8_t byte = table->deltas[(*pos)++];
+        value |= (unsigned)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    return value;
+}
+
+/* Encodes the source lines of the final code. A line position covers the
+ * bytes up to the next one; empty ones, like dropped lines, are skipped. */
+void build_line_table(Code *code) {
+    Line_Pos_List *positions = code->line_positions;
+    int byte = 0;
+    int line = 1;
+
+    for (size_t i = 0; i < positions->count && i < code->source_lines->count; i++) {
+        int start = positions->positions[i];
+        int end = i+1 < positions->count ? positions->positions[i+1] : (int)code->count;
+        int source = code->source_lines->positions[i];
+        if (end <= start || start < byte || source == line) continue;
+
+        int advance = source - line;
+        add_leb128(code->line_table, (unsigned)(start - byte));
+        add_leb128(code->line_table, advance < 0 ? ~((unsigned)advance << 1) : (unsigned)advance << 1);
+        byte = start;
+        line = source;
+    }
+
+    plea_free(code->source_lines->positions);
+    *code->source_lines = (Line_Pos_List){0};
+}
+
+int advance_line_cursor(Code *code, Line_Cursor *cursor, int pos) {
+    Line_Table *table = code->line_table;
+    while (cursor->at < table->count) {
+        size_t at = cursor->at;
+        int byte = cursor->byte + (int)read_leb128(table, &at);
+        if (byte > pos) break;
+
+        unsigned advance = read_leb128(table, &at);
+        cursor->line += advance & 1 ? (int)~(advance >> 1) : (int)(advance >> 1);
+        cursor->byte = byte;
+        cursor->at = at;
+    }
+    return cursor->line;
+}
+
+int source_line(Code *code, int pos) {
+    Line_Cursor cursor = { .at = 0, .byte = 0, .line = 1 };
+    return advance_line_cursor(code, &cursor, pos);
+}
+
+Code *compile(Token_List *tokens, int opt_level, int jobs) {
+    Code *code = jobs > 1 ? compile_parallel(tokens, opt_level, jobs, NULL) : NULL;
+    if (code) {
+        if (opt_level > 0) lower_static_whens(code);
+        build_line_table(code);
+        return code;
+    }
+
+    if (opt_level == 0) {
+        code = compile_pass(tokens, opt_level, NULL);
+        build_line_table(code);
+        return code;
+    }
+
+    Analysis analysis = {0};
+    code = compile_pass(tokens, opt_level, &analysis);
+    find_dead_lines(&analysis, code);
+    free_code(code);
+
+    analysis.line = 0;
+    code = compile_pass(tokens, opt_level, &analysis);
+    lower_static_whens(code);
+    build_line_table(code);
+
+    plea_free(analysis.lines.lines);
+    plea_free(analysis.calls.edges);
+    plea_free(analysis.jumps.edges);
+    plea_free(analysis.dead);
+    return code;
+}
+
+/* Compiles like compile, reusing what it can of the functions cache holds
+ * from the last build. A source that does not split into functions is
+ * compiled whole and leaves the cache empty. */
+Code *compile_cached(Token_List *tokens, int opt_level, int jobs, Unit_Cache *cache) {
+    int warm = cache->count > 0;
+    Code *code = compile_parallel(tokens, opt_level, jobs, cache);
+    if (!code && warm) code = compile_parallel(tokens, opt_level, jobs, cache);
+    if (!code) return compile(tokens, opt_level, 1);
+
+    if (opt_level > 0) lower_static_whens(code);
+    build_line_table(code);
+    return code;
+}
+
+void free_code(Code *code) {
+    plea_free(code->line_positions->positions);
+    plea_free(code->line_positions);
+    plea_free(code->source_lines->positions);
+    plea_free(code->source_lines);
+    plea_free(code->line_table->deltas);
+    plea_free(code->line_table);
+    for (size_t i = 0; i < code->function_list->count; i++) {
+        plea_free(code->function_list->functions[i].name);
+        free_vars(code->function_list->functions[i].vars, code->function_list->functions[i].vars_count);
+    }
+    plea_free(code->function_list->functions);
+    plea_free(code->function_list);
+    plea_free(code->constant_list->constants);
+    plea_free(code->constant_list);
+    plea_free(code->bytes);
+    plea_free(code);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include "lexer.h"
@@ -19,15 +20,43 @@ typedef enum {
     OP_SET_LEN, OP_SET_ARRAY,
     OP_RETS, OP_JMPBSI, OP_JMPBSC,
     OP_SETP_INDEX, OP_SETP_LEN,
+    OP_PUSH_INDEX_I, OP_PUSH_INDEX_C,
+    OP_SET_INDEX_I, OP_SET_INDEX_C,
+    OP_SETP_INDEX_I, OP_SETP_INDEX_C,
+    OP_BULK, OP_TAILCALL,
+    OP_DROP,
+    OP_TEST, OP_TEST_NOT,
+    OP_INC_F, OP_DEC_F,
+    OP_ADD_F, OP_SUB_F,
+    OP_TEST_F, OP_TEST_NOT_F,
 } Op_Code;
 
+/* Mode pushed before a WHEN/PROMISE: bits 1 and 2 mark the two sides as
+ * variable slots, WHEN_REAL compares them as floats */
+#define WHEN_REAL 4
+
+typedef enum {
+    BULK_FILL_IMM,
+    BULK_FILL_CONST,
+    BULK_FILL_VAR,
+    BULK_COPY,
+    BULK_LOAD,
+    BULK_UNTIL_NE,
+} Bulk_Op;
+
+typedef enum {
+    VALUE_INT = 0,
+    VALUE_ARRAY = 1,
+    VALUE_REAL = 2,
+} Value_Tag;
+
+#define VALUE_TAG_MASK 7u
+
+/* 8 bytes: tag in the low bits, a 32-bit int or float payload in the high
+ * half or an Array pointer (malloc alignment keeps its low bits clear).
+ * Zeroed memory reads as the integer 0, and as the float 0.0. */
 typedef struct {
-    int type;
-    union {
-        int integer;
-        float real;
-        uintptr_t pointer;
-    } as;
+    uint64_t bits;
 } Value;
 
 typedef union Value32 {
@@ -35,23 +64,80 @@ typedef union Value32 {
     float real;
 } Value32;
 
+typedef enum {
+    ARRAY_UNKNOWN,
+    ARRAY_INT,
+    ARRAY_FLOAT,
+    ARRAY_CHAR,
+} Array_Kind;
+
 typedef struct {
     char *name;
     int type;
+    Array_Kind array_kind;
 } Var;
 
+/* refs counts the stack and variable slots holding the array; it is
+ * freed when the last one lets go */
 typedef struct {
     size_t len;
-    Value32 *items;
+    Array_Kind kind;
+    int refs;
+    union {
+        Value32 *words;
+        uint8_t *bytes;
+    } items;
 } Array;
 
+static inline Value value_int(int integer) {
+    return (Value){ .bits = (uint64_t)(uint32_t)integer << 32 | VALUE_INT };
+}
+
+static inline Value value_real(float real) {
+    return (Value){ .bits = (uint64_t)(uint32_t)(Value32){ .real = real }.integer << 32 | VALUE_REAL };
+}
+
+static inline Value value_array(Array *array) {
+    return (Value){ .bits = (uint64_t)(uintptr_t)array | VALUE_ARRAY };
+}
+
+static inline int value_is_int(Value value) {
+    return (value.bits & VALUE_TAG_MASK) == VALUE_INT;
+}
+
+static inline int value_is_real(Value value) {
+    return (value.bits & VALUE_TAG_MASK) == VALUE_REAL;
+}
+
+static inline int value_is_array(Value value) {
+    return (value.bits & VALUE_TAG_MASK) == VALUE_ARRAY;
+}
+
+static inline int value_as_int(Value value) {
+    return (int)(int32_t)(uint32_t)(value.bits >> 32);
+}
+
+/* Float ops trust the compiler's types: the payload is read as a float
+ * whatever the tag, so float array elements pushed as ints work too */
+static inline float value_as_real(Value value) {
+    return (Value32){ .integer = value_as_int(value) }.real;
+}
+
+static inline Array *value_as_array(Value value) {
+    return (Array *)(uintptr_t)(value.bits & ~(uint64_t)VALUE_TAG_MASK);
+}
+
 typedef struct {
     char *name;
     int location;
     int arity;
+    int stack_args;
     Var *vars;
     int vars_count;
     int return_type;
+    int ret_val_pos;
+    int inline_tokens;
+    int max_depth;
 } Function;
 
 typedef struct {
@@ -72,6 +158,25 @@ typedef struct {
     int *positions;
 } Line_Pos_List;
 
+/* The source line of every byte, as rows of a line program: the bytes to
+ * advance as an unsigned LEB128, then the lines to advance zigzag-encoded
+ * the same way. Starts at byte 0 on line 1 and has a row wherever the line
+ * changes, so a statement usually costs two bytes. */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    uint8_t *deltas;
+} Line_Table;
+
+/* Where a walk through a line table is; only ever moves forward */
+typedef struct {
+    size_t at;
+    int byte;
+    int line;
+} Line_Cursor;
+
+/* source_lines holds the source line of each line position while
+ * compiling; it is encoded into line_table once the code is final */
 typedef struct {
     size_t count;
     size_t capacity;
@@ -79,15 +184,178 @@ typedef struct {
     Function_List *function_list;
     Constant_List *constant_list;
     Line_Pos_List *line_positions;
+    Line_Pos_List *source_lines;
+    Line_Table *line_table;
 } Code;
 
+typedef struct {
+    int start;
+    int function;
+    Token_Kind kind;
+    int jumps;
+} Line_Info;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Line_Info *lines;
+} Line_Info_List;
+
+typedef struct {
+    int from;
+    int to;
+} Edge;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Edge *edges;
+} Edge_List;
+
+/* Filled in by a first compile: every line with the line position it
+ * starts at, calls between functions and jumps from lines to line
+ * positions. dead then marks the lines the second compile drops. */
+typedef struct {
+    Line_Info_List lines;
+    Edge_List calls;
+    Edge_List jumps;
+    uint8_t *dead;
+    int line;
+} Analysis;
+
+/* A when in main and the code after its JMPBSI it can fire in: from start
+ * up to the unconditional jump at end that closes the loop around it */
+typedef struct {
+    int pos;
+    int body;
+    int slots[2];
+    int start;
+    int end;
+    int closes_on_line;
+    int writes_last;
+    int left_early;
+    int entered;
+    int bulk;
+    int jump_body;
+    int confined;
+    uint8_t writes[256];
+} Guarded_When;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Guarded_When *whens;
+} Guarded_When_List;
+
+/* One function of a parallel compile: its tokens from FNCTN to the
+ * closing semicolon, what it took up in the last round and where it goes
+ * in the linked code */
+typedef struct {
+    int start;
+    int end;
+    int bytes;
+    int entries;
+    int lines;
+    int byte_base;
+    int line_base;
+    int line_index;
+    uint32_t hash;
+    int compiled;
+    int cached;
+    Code *code;
+    Analysis analysis;
+} Compile_Unit;
+
+/* What one round made of a function, with everything besides its source
+ * that went in. ret_val_pos is kept relative to the function's first
+ * token and the code's source lines to its first line. */
+typedef struct {
+    int publish;
+    int line_base;
+    int byte_base;
+    int line_index;
+    uint32_t dead_hash;
+    int diverged;
+    int bytes;
+    int entries;
+    int lines;
+    Code *code;
+    Analysis analysis;
+    Function function;
+} Unit_Round;
+
+#define UNIT_ROUNDS 3
+
+/* A function of the last build. interface hashes its header and what it
+ * published, which is all the other functions' code depends on. */
+typedef struct {
+    char *name;
+    uint32_t hash;
+    uint32_t interface;
+    int start;
+    int source_line;
+    int rounds;
+    Unit_Round round[UNIT_ROUNDS];
+} Cached_Unit;
+
+/* Kept across builds by --watch: a function whose source, bases and dead
+ * lines are unchanged reuses its code instead of being compiled again */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Cached_Unit *units;
+    int opt_level;
+    int compiled;
+} Unit_Cache;
+
+/* Compiles every function on its own thread, each into its own Code. The
+ * first round publishes each function's signature and return type to
+ * functions when done, and calls wait for their callee there. */
+typedef struct {
+    Token_List *tokens;
+    int opt_level;
+    Analysis *analysis;
+    Function_List functions;
+    size_t count;
+    size_t capacity;
+    Compile_Unit *units;
+    size_t next;
+    int publish;
+    int diverged;
+    Unit_Cache *cache;
+    Unit_Cache *next_cache;
+    uint8_t *done;
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+} Compile_Pool;
+
 typedef struct {
     Code *code;
     Token_List *tokens;
+    Analysis *analysis;
     Function *cur_function;
+    Function_List *declared;
+    Compile_Pool *pool;
+    int function_index;
+    int line_base;
+    int byte_base;
+    int function_pos;
+    int var_base;
+    int opt_level;
     int pos;
     int is_in_function;
+    int in_tail_position;
+    int in_statement;
     int ret_val_pos;
 } Compiler;
 
-Code *compile(Token_List *tokens);
+#define INLINE_MAX_TOKENS 16
+
+Code *compile(Token_List *tokens, int opt_level, int jobs);
+Code *compile_cached(Token_List *tokens, int opt_level, int jobs, Unit_Cache *cache);
+void free_unit_cache(Unit_Cache *cache);
+int instruction_length(Code *code, int pos);
+int advance_line_cursor(Code *code, Line_Cursor *cursor, int pos);
+int source_line(Code *code, int pos);
+uint32_t hash_bytes(uint32_t hash, const void *data, size_t length);
+void free_code(Code *code);
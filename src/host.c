@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "host.h"
+
+#define HOST_EVENTS 64
+
+void host_init(Host *host, Code *code, int headroom, Run_Options *options) {
+    *host = (Host){
+        .code = code,
+        .headroom = headroom,
+        .options = options,
+        .epoll_fd = epoll_create1(EPOLL_CLOEXEC),
+        .listen_fd = -1,
+    };
+    if (host->epoll_fd < 0) {
+        fprintf(stderr, "Could not start the host\n");
+        exit(1);
+    }
+    /* A peer that hangs up shows as a failed write, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/* Several hosts can share one listening socket; each connection wakes
+ * only one of them */
+void host_listen(Host *host, int listen_fd) {
+    host->listen_fd = listen_fd;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    epoll_ctl(host->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+}
+
+void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void queue_session(Host *host, Session *session) {
+    if (session->queued) return;
+    session->queued = 1;
+    session->next_ready = NULL;
+    if (host->ready_tail) host->ready_tail->next_ready = session;
+    else host->ready = session;
+    host->ready_tail = session;
+}
+
+/* The host owns the fds from here on and closes them with the session */
+Session *host_add(Host *host, int in_fd, int out_fd) {
+    Session *session = plea_calloc(SITE_VMS, 1, sizeof(Session));
+    session->in_fd = in_fd;
+    session->out_fd = out_fd;
+    session->options = *host->options;
+    session->options.trace_path = NULL;
+    session->options.hwcounters = 0;
+    session->options.snapshot_path = NULL;
+    session->options.snapshot_every = 0;
+    session->options.input = NULL;
+    session->options.record = NULL;
+    session->options.output = open_memstream(&session->output, &session->output_size);
+
+    session->vm = vm_new(host->code, host->headroom, &session->options);
+    session->vm->hosted = 1;
+
+    set_nonblocking(in_fd);
+    set_nonblocking(out_fd);
+    session->in_events = EPOLLIN;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = session };
+    epoll_ctl(host->epoll_fd, EPOLL_CTL_ADD, in_fd, &event);
+    if (out_fd != in_fd) {
+        event.events = 0;
+        epoll_ctl(host->epoll_fd, EPOLL_CTL_ADD, out_fd, &event);
+    }
+
+    host->sessions++;
+    queue_session(host, session);
+    return session;
+}
+
+void close_session(Host *host, Session *session) {
+    close(session->in_fd);
+    if (session->out_fd != session->in_fd) close(session->out_fd);
+    vm_free(session->vm);
+    fclose(session->options.output);
+    free(session->output);
+
+    session->closed = 1;
+    session->next_dead = host->dead;
+    host->dead = session;
+    host->sessions--;
+}
+
+void set_events(Host *host, Session *session, int fd, uint32_t *current, uint32_t wanted) {
+    if (*current == wanted) return;
+    *current = wanted;
+    struct epoll_event event = { .events = wanted, .data.ptr = session };
+    epoll_ctl(host->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/* Reads while there is room for it and sends while output is waiting */
+void watch_session(Host *host, Session *session) {
+    uint32_t in = !session->input_eof && session->input_len < HOST_INPUT_SIZE ? EPOLLIN : 0;
+    uint32_t out = session->output_sent < session->output_size ? EPOLLOUT : 0;
+    if (session->out_fd == session->in_fd) {
+        set_events(host, session, session->in_fd, &session->in_events, in | out);
+    }
+    else {
+        set_events(host, session, session->in_fd, &session->in_events, in);
+        set_events(host, session, session->out_fd, &session->out_events, out);
+    }
+}
+
+void read_session(Session *session) {
+    if (session->input_eof || session->input_len == HOST_INPUT_SIZE) return;
+    ssize_t n = read(session->in_fd, session->input + session->input_len, HOST_INPUT_SIZE - session->input_len);
+    if (n > 0) session->input_len += n;
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR)) session->input_eof = 1;
+}
+
+/* Sends what the peer will take; a stream sent in full starts over
+ * empty. Returns 0 once the peer can no longer be written to. */
+int send_output(Session *session) {
+    fflush(session->options.output);
+    while (session->output_sent < session->output_size) {
+        ssize_t n = write(session->out_fd, session->output + session->output_sent, session->output_size - session->output_sent);
+        if (n > 0) {
+            session->output_sent += n;
+        }
+        else if (errno == EAGAIN || errno == EINTR) {
+            return 1;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    if (session->output_size > 0) {
+        fclose(session->options.output);
+        free(session->output);
+        session->output = NULL;
+        session->output_size = 0;
+        session->output_sent = 0;
+        session->options.output = open_memstream(&session->output, &session->output_size);
+    }
+    return 1;
+}
+
+/* Hands the VM its next line the way fgets would cut it: up to a newline
+ * or 63 bytes, or what is left once the peer is done */
+void give_input(Session *session) {
+    Vm *vm = session->vm;
+    if (vm->status != VM_NEEDS_INPUT || vm->input_ready || vm->input_ended) return;
+
+    size_t limit = session->input_len < sizeof(vm->input) - 1 ? session->input_len : sizeof(vm->input) - 1;
+    char *newline = memchr(session->input, '\n', limit);
+    size_t length = newline ? (size_t)(newline - session->input) + 1
+        : limit == sizeof(vm->input) - 1 || session->input_eof ? limit
+        : 0;
+
+    if (length > 0) {
+        memcpy(vm->input, session->input, length);
+        vm->input_len = length;
+        vm->input_ready = 1;
+        session->input_len -= length;
+        memmove(session->input, session->input + length, session->input_len);
+    }
+    else if (session->input_eof) {
+        vm->input_ended = 1;
+    }
+}
+
+int vm_ended(Vm *vm) {
+    return vm->status == VM_HALTED || vm->status == VM_FAILED;
+}
+
+/* Runs the session's VM until it has to wait for its peer or has burnt a
+ * slice of fuel, in which case it goes to the back of the ready list */
+void step_session(Host *host, Session *session) {
+    if (session->closed) return;
+    Vm *vm = session->vm;
+
+    int ok = send_output(session);
+    while (ok && !vm_ended(vm) && session->output_size - session->output_sent < HOST_OUTPUT_MAX) {
+        give_input(session);
+        if (vm->status == VM_NEEDS_INPUT && !vm->input_ready && !vm->input_ended) break;
+
+        Vm_Status status = vm_run_for(vm, HOST_SLICE);
+        ok = send_output(session);
+        if (status == VM_YIELDED) {
+            queue_session(host, session);
+            break;
+        }
+    }
+
+    if (!ok || (vm_ended(vm) && session->output_sent == session->output_size)) {
+        close_session(host, session);
+    }
+    else {
+        watch_session(host, session);
+    }
+}
+
+void accept_sessions(Host *host) {
+    for (;;) {
+        int fd = accept4(host->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        host_add(host, fd, fd);
+    }
+}
+
+/* Returns once every session has ended, which for a listening host is
+ * never */
+void host_run(Host *host) {
+    struct epoll_event events[HOST_EVENTS];
+
+    while (host->sessions > 0 || host->listen_fd >= 0) {
+        int count = epoll_wait(host->epoll_fd, events, HOST_EVENTS, host->ready ? 0 : -1);
+        if (count < 0 && errno != EINTR) {
+            fprintf(stderr, "Could not wait for sessions\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < count; i++) {
+            Session *session = events[i].data.ptr;
+            if (session == NULL) {
+                accept_sessions(host);
+                continue;
+            }
+            if (session->closed) continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_session(session);
+            step_session(host, session);
+        }
+
+        /* Sessions queued while this round runs wait for the next one */
+        Session *ready = host->ready;
+        host->ready = host->ready_tail = NULL;
+        while (ready) {
+            Session *next = ready->next_ready;
+            ready->queued = 0;
+            step_session(host, ready);
+            ready = next;
+        }
+
+        while (host->dead) {
+            Session *dead = host->dead;
+            host->dead = dead->next_dead;
+            plea_free(dead);
+        }
+    }
+}
+
+void host_free(Host *host) {
+    close(host->epoll_fd);
+}
+
+typedef struct {
+    Code *code;
+    int headroom;
+    Run_Options *options;
+    int listen_fd;
+} Serve_Args;
+
+void *serve_thread(void *data) {
+    Serve_Args *args = data;
+    Host host;
+    host_init(&host, args->code, args->headroom, args->options);
+    host_listen(&host, args->listen_fd);
+    host_run(&host);
+    host_free(&host);
+    return NULL;
+}
+
+/* Takes connections on the loopback port, each running the program from
+ * the start, spread over threads that each host their own */
+void serve(Code *code, Run_Options *options, int port, int threads) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on port %d\n", port);
+        exit(1);
+    }
+    fprintf(stderr, "Serving on port %d with %d threads\n", port, threads);
+
+    Serve_Args args = {
+        .code = code,
+        .headroom = verify(code),
+        .options = options,
+        .listen_fd = listen_fd,
+    };
+    pthread_t *workers = plea_alloc(SITE_VMS, threads * sizeof(pthread_t));
+    for (int i = 1; i < threads; i++) pthread_create(&workers[i], NULL, serve_thread, &args);
+    serve_thread(&args);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/* Input read ahead for a session, and output it may have unsent before
+ * its VM is paused */
+#define HOST_INPUT_SIZE 4096
+#define HOST_OUTPUT_MAX 65536
+
+/* Instructions a session runs before the next ready one gets a turn */
+#define HOST_SLICE 65536
+
+/* One run of the program for a peer, reading lines from in_fd and writing
+ * to out_fd, which may be the same socket. Output collects in a memory
+ * stream and is sent as far as the peer takes it. */
+typedef struct Session Session;
+struct Session {
+    Vm *vm;
+    Run_Options options;
+    int in_fd;
+    int out_fd;
+    uint32_t in_events;
+    uint32_t out_events;
+    char *output;
+    size_t output_size;
+    size_t output_sent;
+    size_t input_len;
+    int input_eof;
+    int queued;
+    int closed;
+    Session *next_ready;
+    Session *next_dead;
+    char input[HOST_INPUT_SIZE];
+};
+
+/* Runs sessions of one program on one thread. A session whose VM used up
+ * its slice waits in the ready list; the others wait on epoll for their
+ * fds. Sessions are freed only after a round is over, since later events
+ * of the same round may still name them. */
+typedef struct {
+    Code *code;
+    int headroom;
+    Run_Options *options;
+    int epoll_fd;
+    int listen_fd;
+    size_t sessions;
+    Session *ready;
+    Session *ready_tail;
+    Session *dead;
+} Host;
+
+void host_init(Host *host, Code *code, int headroom, Run_Options *options);
+void host_listen(Host *host, int listen_fd);
+Session *host_add(Host *host, int in_fd, int out_fd);
+void host_run(Host *host);
+void host_free(Host *host);
+void serve(Code *code, Run_Options *options, int port, int threads);
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "hwcounters.h"
+#include "vm.h"
+
+#define HW_CALIBRATION 64
+
+typedef struct {
+    char *name;
+    uint32_t type;
+    uint64_t config;
+} Hw_Event;
+
+static const Hw_Event hw_events[HW_COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1D misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+        | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+
+/* The counters that opened form one group, read together. Each delta goes
+ * to the opcode dispatched before it, less what reading itself costs. */
+static struct {
+    FILE *out;
+    int leader;
+    int opened;
+    int slot[HW_COUNTERS];
+    int op;
+    uint64_t last[HW_COUNTERS];
+    uint64_t overhead[HW_COUNTERS];
+    uint64_t dispatches[256];
+    uint64_t totals[256][HW_COUNTERS];
+} hw = { .leader = -1, .op = -1 };
+
+int open_counter(const Hw_Event *event, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* Fills values in hw_events order, with 0 for counters that did not open */
+void read_counters(uint64_t *values) {
+    uint64_t group[1 + HW_COUNTERS];
+    if (read(hw.leader, group, sizeof(group)) < (ssize_t)sizeof(uint64_t)) {
+        memset(group, 0, sizeof(group));
+    }
+    for (int i = 0; i < HW_COUNTERS; i++) {
+        values[i] = hw.slot[i] >= 0 ? group[1 + hw.slot[i]] : 0;
+    }
+}
+
+int compare_cycles(const void *a, const void *b) {
+    uint64_t x = hw.totals[*(const int *)a][0];
+    uint64_t y = hw.totals[*(const int *)b][0];
+    if (x != y) return x < y ? 1 : -1;
+    return *(const int *)a - *(const int *)b;
+}
+
+void print_rate(FILE *out, int counter, uint64_t count, uint64_t per) {
+    if (hw.slot[counter] < 0 || per == 0) fprintf(out, " %10s", "-");
+    else fprintf(out, " %10.3f", (double)count / (double)per);
+}
+
+/* Opcodes heaviest in cycles first, with IPC and misses per dispatch. The
+ * last dispatch before the run stopped is left uncharged. */
+void hwcounters_report(void) {
+    FILE *out = hw.out;
+
+    int ops[256];
+    int count = 0;
+    for (int op = 0; op < 256; op++) {
+        if (hw.dispatches[op] > 0) ops[count++] = op;
+    }
+    qsort(ops, count, sizeof(int), compare_cycles);
+
+    fprintf(out, "%-13s %12s %14s %14s %10s %10s %10s %10s\n", "op", "dispatches", "cycles", "instructions",
+            "IPC", "cycles/op", "br miss/op", "L1D miss/op");
+    uint64_t sums[HW_COUNTERS] = { 0 };
+    for (int i = 0; i < count; i++) {
+        uint64_t *totals = hw.totals[ops[i]];
+        char *name = op_name((uint8_t)ops[i]);
+        fprintf(out, "%-13s %12llu %14llu %14llu", name ? name : "?", (unsigned long long)hw.dispatches[ops[i]],
+                (unsigned long long)totals[0], (unsigned long long)totals[1]);
+        print_rate(out, 1, totals[1], hw.slot[0] >= 0 ? totals[0] : 0);
+        print_rate(out, 0, totals[0], hw.dispatches[ops[i]]);
+        print_rate(out, 2, totals[2], hw.dispatches[ops[i]]);
+        print_rate(out, 3, totals[3], hw.dispatches[ops[i]]);
+        fprintf(out, "\n");
+        for (int c = 0; c < HW_COUNTERS; c++) sums[c] += totals[c];
+    }
+
+    fprintf(out, "counted:");
+    for (int c = 0; c < HW_COUNTERS; c++) {
+        if (hw.slot[c] >= 0) fprintf(out, " %llu %s,", (unsigned long long)sums[c], hw_events[c].name);
+    }
+    if (hw.slot[1] >= 0) fprintf(out, " less %llu instructions per read", (unsigned long long)hw.overhead[1]);
+    fprintf(out, "\n");
+    if (hw.slot[0] >= 0 && sums[0] == 0) {
+        fprintf(out, "the counters opened but never counted, so the machine may not expose them\n");
+    }
+}
+
+int hwcounters_start(FILE *out) {
+    int error = 0;
+    for (int i = 0; i < HW_COUNTERS; i++) {
+        int fd = open_counter(&hw_events[i], hw.leader);
+        if (fd < 0) {
+            if (!error) error = errno;
+            hw.slot[i] = -1;
+            continue;
+        }
+        if (hw.leader == -1) hw.leader = fd;
+        hw.slot[i] = hw.opened++;
+    }
+    if (hw.leader == -1) {
+        fprintf(stderr, "Hardware counters are unavailable (%s), running without them\n", strerror(error));
+        return 0;
+    }
+    for (int i = 0; i < HW_COUNTERS; i++) {
+        if (hw.slot[i] < 0) fprintf(stderr, "Could not open the %s counter, leaving it out\n", hw_events[i].name);
+    }
+    ioctl(hw.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    /* The least two reads in a row ever differ by is taken as the cost of
+     * reading, which every delta includes once */
+    uint64_t before[HW_COUNTERS];
+    uint64_t after[HW_COUNTERS];
+    for (int c = 0; c < HW_COUNTERS; c++) hw.overhead[c] = UINT64_MAX;
+    for (int i = 0; i < HW_CALIBRATION; i++) {
+        read_counters(before);
+        read_counters(after);
+        for (int c = 0; c < HW_COUNTERS; c++) {
+            if (after[c] - before[c] < hw.overhead[c]) hw.overhead[c] = after[c] - before[c];
+        }
+    }
+
+    hw.out = out;
+    atexit(hwcounters_report);
+    return 1;
+}
+
+/* Called before each dispatch of op; charges what ran since the last call
+ * to the opcode dispatched then */
+void hwcounters_step(uint8_t op) {
+    uint64_t now[HW_COUNTERS];
+    read_counters(now);
+    if (hw.op >= 0) {
+        hw.dispatches[hw.op]++;
+        for (int c = 0; c < HW_COUNTERS; c++) {
+            uint64_t delta = now[c] - hw.last[c];
+            hw.totals[hw.op][c] += delta > hw.overhead[c] ? delta - hw.overhead[c] : 0;
+        }
+    }
+    hw.op = op;
+    memcpy(hw.last, now, sizeof(now));
+}
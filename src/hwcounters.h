@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HW_COUNTERS 4
+
+/* Opens cycle, instruction, branch miss and L1D miss counters for this
+ * process in user space; the report is written to out when the process
+ * exits. Counters the machine or container does not allow are left out,
+ * and if none can be opened it says so and returns 0. */
+int hwcounters_start(FILE *out);
+void hwcounters_step(uint8_t op);
@@ -5,7 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc.h"
 #include "lexer.h"
+#include "scan.h"
 
 #define NUM_KEYWORDS 37
 
@@ -19,189 +21,274 @@ static const char *keywords[] = {
     "then", "lng", "of", "jmp", "catch", "error", "defl", "", "\0",
 };
 
-void add_token(Token_List *token_list, Token_Kind token_kind) {
-    Token token = {
-        .kind = token_kind,
-        .val.int_val = 0
-    };
-    if (token_list->count == token_list->capacity) {
-        token_list->capacity *= 2;
-        token_list->toks = realloc(token_list->toks, token_list->capacity * sizeof(token));
-        assert(token_list->toks != NULL);
+/* Reports where the lexer is, which is always on the last line seen */
+void lex_error(Lexer *lexer, char *message) {
+    size_t line_start = lexer->lines.starts[lexer->lines.count-1];
+    fprintf(stderr, "%zu:%zu: %s\n", lexer->lines.count, lexer->pos - line_start + 1, message);
+    exit(1);
+}
+
+uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
-    token_list->toks[token_list->count] = token;
-    token_list->count++;
+    return hash;
 }
 
-void lex_error(char *message) {
-    fprintf(stderr, "%s", message);
-    exit(1);
+/* Slot of the length bytes at name, added as an identifier if new */
+size_t intern(Name_Table *names, const char *name, size_t length) {
+    if (2*(names->count+1) > names->capacity) {
+        Name_Table grown = {
+            .count = names->count,
+            .capacity = names->capacity ? names->capacity*2 : 64,
+        };
+        grown.names = plea_calloc(SITE_NAMES, grown.capacity, sizeof(char *));
+        grown.kinds = plea_alloc(SITE_NAMES, grown.capacity * sizeof(Token_Kind));
+
+        for (size_t i = 0; i < names->capacity; i++) {
+            if (!names->names[i]) continue;
+            size_t slot = hash_name(names->names[i], strlen(names->names[i])) & (grown.capacity-1);
+            while (grown.names[slot]) slot = (slot+1) & (grown.capacity-1);
+            grown.names[slot] = names->names[i];
+            grown.kinds[slot] = names->kinds[i];
+        }
+        plea_free(names->names);
+        plea_free(names->kinds);
+        *names = grown;
+    }
+
+    size_t slot = hash_name(name, length) & (names->capacity-1);
+    while (names->names[slot]) {
+        if (strncmp(names->names[slot], name, length) == 0 && names->names[slot][length] == '\0') return slot;
+        slot = (slot+1) & (names->capacity-1);
+    }
+
+    names->names[slot] = plea_alloc(SITE_NAMES, length+1);
+    memcpy(names->names[slot], name, length);
+    names->names[slot][length] = '\0';
+    names->kinds[slot] = IDENT;
+    names->count++;
+    return slot;
+}
+
+char current(Lexer *lexer) {
+    return lexer->pos < lexer->len ? lexer->src[lexer->pos] : '\0';
 }
 
 char consume(Lexer *lexer) {
     lexer->pos++;
-    return lexer->src[lexer->pos];
+    return current(lexer);
 }
 
 char peek(Lexer *lexer) {
-    return lexer->src[lexer->pos+1];
+    return lexer->pos+1 < lexer->len ? lexer->src[lexer->pos+1] : '\0';
 }
 
-char current(Lexer *lexer) {
-    return lexer->src[lexer->pos];
+void add_line_start(Line_Starts *lines, size_t start) {
+    if (lines->count == lines->capacity) {
+        lines->capacity = lines->capacity ? lines->capacity*2 : 64;
+        lines->starts = plea_realloc(SITE_TOKENS, lines->starts, lines->capacity * sizeof(uint32_t));
+    }
+    lines->starts[lines->count++] = (uint32_t)start;
 }
 
-void lex_number(Lexer *lexer) {
-    add_token(lexer->tokens, INTEGER);
-    Token_Kind *token_kind = &lexer->tokens->toks[lexer->tokens->count-1].kind;
-    char number[48];
-
-    char c = current(lexer);
-    if (c == '-') {
-        number[0] = '-';
-        c = consume(lexer);
+/* Newlines only appear in whitespace, so its runs are where lines start.
+ * They are short, which makes a plain loop cheaper than memchr. Stops on
+ * the last byte of the run, like a token. */
+void skip_space(Lexer *lexer) {
+    size_t end = scan_while(lexer->src, lexer->pos, lexer->len, SCAN_SPACE);
+    for (size_t i = lexer->pos; i < end; i++) {
+        if (lexer->src[i] == '\n') add_line_start(&lexer->lines, i+1);
     }
+    lexer->pos = end - 1;
+}
 
-    for (int i = 0; c != '\n'; i++) {
-        if (c == '.') *token_kind = REAL;
+/* The token ends on its last byte, which next_token steps over */
+void lex_number(Lexer *lexer, Token *token) {
+    token->kind = INTEGER;
+    char number[48];
 
-        if (i >= 47) lex_error("Number is too big");
+    if (current(lexer) == '-') consume(lexer);
 
-        number[i] = c;
-        number[i+1] = '\0';
+    size_t start = lexer->pos;
+    size_t length = scan_while(lexer->src, start+1, lexer->len, SCAN_NUMBER) - start;
+    if (length > 47) lex_error(lexer, "Number is too big");
 
-        if (peek(lexer) == '\0' || (!isdigit(peek(lexer)) && peek(lexer) != '.')) break;
-        c = consume(lexer);
-    }
+    memcpy(number, &lexer->src[start], length);
+    number[length] = '\0';
+    if (memchr(number, '.', length)) token->kind = REAL;
+    lexer->pos = start + length - 1;
 
-    if (*token_kind == REAL) {
-        lexer->tokens->toks[lexer->tokens->count-1].val.real_val = strtof(number, NULL);
+    if (token->kind == REAL) {
+        token->val.real_val = strtof(number, NULL);
     }
     else {
-        lexer->tokens->toks[lexer->tokens->count-1].val.int_val = (int)strtol(number, NULL, 10);
+        token->val.int_val = (int)strtol(number, NULL, 10);
     }
 }
 
-void lex_ident_or_keyword(Lexer *lexer) {
-    add_token(lexer->tokens, NONE);
-    char *ident_name = lexer->tokens->toks[lexer->tokens->count-1].val.ident_name;
-    Token_Kind *token_kind = &lexer->tokens->toks[lexer->tokens->count-1].kind;
-
-    char c = current(lexer);
-    for (int i = 0; c != '\n'; i++) {
-        if (i > 255) lex_error("Identifier is too long");
-
-        ident_name[i] = c;
-        ident_name[i+1] = '\0';
-
-        if (peek(lexer) == '\0' || (!isalnum(peek(lexer)) && peek(lexer) != '_')) break;
-        c = consume(lexer);
-    }
-
-    for (int i = 0; i < NUM_KEYWORDS; i++) {
-        if (strcmp(ident_name, keywords[i]) == 0) {
-            *token_kind = i+11;
-            break;
-        }
-    }
+void lex_ident_or_keyword(Lexer *lexer, Token *token) {
+    size_t start = lexer->pos;
+    size_t length = scan_while(lexer->src, start+1, lexer->len, SCAN_IDENT) - start;
+    if (length > 256) lex_error(lexer, "Identifier is too long");
+    lexer->pos = start + length - 1;
 
-    if (*token_kind == NONE) *token_kind = IDENT;
+    size_t slot = intern(&lexer->names, &lexer->src[start], length);
+    token->kind = lexer->names.kinds[slot];
+    token->val.ident_name = lexer->names.names[slot];
 }
 
-void lex_string(Lexer *lexer) {
-    add_token(lexer->tokens, STRING);
-    char *ident_name = lexer->tokens->toks[lexer->tokens->count-1].val.ident_name;
-
-    char c = consume(lexer);
-    int i = 0;
-    while (c != '\"') {
-        if (c == '\n') lex_error("Premature end of line");
-        if (c == '\0') lex_error("Premature end of file");
+void lex_string(Lexer *lexer, Token *token) {
+    size_t start = lexer->pos+1;
+    size_t length = scan_while(lexer->src, start, lexer->len, SCAN_STRING) - start;
+    if (length > 255) lex_error(lexer, "I'm not reading all that");
 
-        if (i >= 255) lex_error("I'm not reading all that");
+    lexer->pos = start + length;
+    char c = current(lexer);
+    if (c == '\n') lex_error(lexer, "Premature end of line");
+    if (c != '\"') lex_error(lexer, "Premature end of file");
 
-        ident_name[i] = c;
-        c = consume(lexer);
-        i++;
-    }
-    ident_name[i+1] = '\0';
+    /* intern can grow the table, so the slot is looked up first */
+    size_t slot = intern(&lexer->names, &lexer->src[start], length);
+    token->kind = STRING;
+    token->val.ident_name = lexer->names.names[slot];
 }
 
-Token_List lex(char *src) {
-    Token_List tokens = {
-        .count = 0,
-        .capacity = 4,
-        .toks = malloc(4 * sizeof(Token))
-    };
-
-    Lexer lexer = {
-        .pos = 0,
-        .src = src,
-        .tokens = &tokens
-    };
+Token next_token(Lexer *lexer) {
+    for (char c = current(lexer); c != '\0'; c = consume(lexer)) {
+        Token token = {
+            .kind = NONE,
+            .offset = (uint32_t)lexer->pos,
+            .val.int_val = 0
+        };
 
-    char c = current(&lexer);
-    while (c != '\0') {
         switch (c) {
-        case '[': add_token(&tokens, L_BRACKET); break;
-        case ']': add_token(&tokens, R_BRACKET); break;
-        case ',': add_token(&tokens, COMMA);     break;
-        case '+': add_token(&tokens, PLUS);      break;
-        case ';': add_token(&tokens, SEMICOLON); break;
-        case '*': add_token(&tokens, STAR);      break;
-        case '@': add_token(&tokens, AT);        break;
-        case '=': add_token(&tokens, EQUALS);    break;
+        case '[': token.kind = L_BRACKET; break;
+        case ']': token.kind = R_BRACKET; break;
+        case ',': token.kind = COMMA;     break;
+        case '+': token.kind = PLUS;      break;
+        case ';': token.kind = SEMICOLON; break;
+        case '*': token.kind = STAR;      break;
+        case '@': token.kind = AT;        break;
+        case '=': token.kind = EQUALS;    break;
         case '-':
-            if (!isdigit(peek(&lexer))) {
-                add_token(&tokens, MINUS);
+            if (!isdigit(peek(lexer))) {
+                token.kind = MINUS;
             }
             else {
-                lex_number(&lexer);
+                lex_number(lexer, &token);
             }
             break;
         case '_':
-            if (peek(&lexer) == '+' || peek(&lexer) == '-') {
-                add_token(&tokens, UNDER);
+            if (peek(lexer) == '+' || peek(lexer) == '-') {
+                token.kind = UNDER;
             }
             else {
-                lex_ident_or_keyword(&lexer);
+                lex_ident_or_keyword(lexer, &token);
             }
             break;
         case ' ':
         case '\r':
         case '\t':
-        case '\n': break;
+        case '\n':
+            skip_space(lexer);
+            continue;
         case '.':
-            if (peek(&lexer) == 'x') {
-                add_token(&tokens, TIMES);
-                consume(&lexer);
+            if (peek(lexer) == 'x') {
+                token.kind = TIMES;
+                consume(lexer);
             }
             else {
-                add_token(&tokens, DOT);
+                token.kind = DOT;
             }
             break;
         case '\"':
-            lex_string(&lexer);
+            lex_string(lexer, &token);
             break;
         default:
             if (isalpha(c)) {
-                lex_ident_or_keyword(&lexer);
+                lex_ident_or_keyword(lexer, &token);
             }
             else if (isdigit(c)) {
-                lex_number(&lexer);
+                lex_number(lexer, &token);
             }
             else {
-                lex_error("Invalid token");
+                lex_error(lexer, "Invalid token");
             }
             break;
         }
-        c = consume(&lexer);
+        consume(lexer);
+        return token;
     }
 
-    add_token(&tokens, T_EOF);
+    return (Token){ .kind = T_EOF, .offset = (uint32_t)lexer->pos, .val.int_val = 0 };
+}
+
+Token_List lex(const char *src, size_t len) {
+    Token_List tokens = {
+        .count = 0,
+        .capacity = 4,
+        .toks = plea_alloc(SITE_TOKENS, 4 * sizeof(Token)),
+        .lexer = (Lexer){
+            .src = src,
+            .len = len,
+            .pos = 0,
+        },
+    };
+
+    add_line_start(&tokens.lexer.lines, 0);
+    for (int i = 0; i < NUM_KEYWORDS; i++) {
+        size_t slot = intern(&tokens.lexer.names, keywords[i], strlen(keywords[i]));
+        if (tokens.lexer.names.kinds[slot] == IDENT) tokens.lexer.names.kinds[slot] = i+11;
+    }
     return tokens;
 }
 
+/* Lexes up to and including token index, or to the end of the source. Past
+ * the end every index reads as T_EOF. */
+Token lex_until(Token_List *tokens, size_t index) {
+    while (tokens->count <= index) {
+        if (tokens->count > 0 && tokens->toks[tokens->count-1].kind == T_EOF) {
+            return tokens->toks[tokens->count-1];
+        }
+
+        if (tokens->count == tokens->capacity) {
+            tokens->capacity *= 2;
+            tokens->toks = plea_realloc(SITE_TOKENS, tokens->toks, tokens->capacity * sizeof(Token));
+            assert(tokens->toks != NULL);
+        }
+        tokens->toks[tokens->count] = next_token(&tokens->lexer);
+        tokens->count++;
+    }
+    return tokens->toks[index];
+}
+
+void free_tokens(Token_List *tokens) {
+    for (size_t i = 0; i < tokens->lexer.names.capacity; i++) {
+        plea_free(tokens->lexer.names.names[i]);
+    }
+    plea_free(tokens->lexer.names.names);
+    plea_free(tokens->lexer.names.kinds);
+    plea_free(tokens->lexer.lines.starts);
+    plea_free(tokens->toks);
+}
+
+/* Line and column of a lexed token, both from 1 */
+void token_position(Token_List *tokens, Token token, int *line, int *col) {
+    Line_Starts *lines = &tokens->lexer.lines;
+    size_t low = 0;
+    size_t high = lines->count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low)/2;
+        if (lines->starts[mid] <= token.offset) low = mid;
+        else high = mid;
+    }
+    *line = (int)low + 1;
+    *col = (int)(token.offset - lines->starts[low]) + 1;
+}
+
 char *token_to_string(Token_Kind type) {
     switch (type) {
     case L_BRACKET: return "L_BRACKET";
@@ -253,6 +340,8 @@ char *token_to_string(Token_Kind type) {
     case SH_FLOAT:  return "SH_FLOAT";
     case NONE:      return "NONE";
     case T_EOF:     return "EOF";
-    default: lex_error("Could not convert token to string"); return NULL;
+    default:
+        fprintf(stderr, "Could not convert token to string\n");
+        exit(1);
     }
 }
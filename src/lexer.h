@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum {
     L_BRACKET, R_BRACKET, COMMA, MINUS, PLUS, SEMICOLON, STAR, UNDER, TIMES, AT, EQUALS,
     IS, NOT,
@@ -12,24 +15,57 @@ typedef enum {
 
 typedef struct {
     Token_Kind kind;
+    uint32_t offset;
     union {
-        char ident_name[256];
+        char *ident_name;
         int int_val;
         float real_val;
     } val;
 } Token;
 
+/* Open-addressed; keywords are interned first, so looking a name up also
+ * tells its token kind */
 typedef struct {
     size_t count;
     size_t capacity;
-    Token *toks;
-} Token_List;
+    char **names;
+    Token_Kind *kinds;
+} Name_Table;
+
+/* Offset of the first byte of each source line, filled in as far as the
+ * source has been lexed */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    uint32_t *starts;
+} Line_Starts;
 
 typedef struct {
-    Token_List *tokens;
-    char *src;
-    int pos;
+    const char *src;
+    size_t len;
+    size_t pos;
+    Name_Table names;
+    Line_Starts lines;
 } Lexer;
 
-Token_List lex(char *src);
+/* Tokens are lexed on demand as the compiler asks for them. Identifier and
+ * string values point into the lexer's name table and a token only keeps
+ * the offset it starts at, so it is 16 bytes and each distinct name is
+ * stored once. */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Token *toks;
+    Lexer lexer;
+} Token_List;
+
+Token_List lex(const char *src, size_t len);
+Token lex_until(Token_List *tokens, size_t index);
+void free_tokens(Token_List *tokens);
+void token_position(Token_List *tokens, Token token, int *line, int *col);
 char *token_to_string(Token_Kind type);
+
+static inline Token token_at(Token_List *tokens, size_t index) {
+    if (index < tokens->count) return tokens->toks[index];
+    return lex_until(tokens, index);
+}
@@ -1,6 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "alloc.h"
+#include "host.h"
+#include "trace.h"
 #include "vm.h"
 
 void display_token(Token token) {
@@ -18,68 +34,364 @@ void display_token(Token token) {
     }
 }
 
-void free_code(Code *code) {
-    free(code->line_positions->positions);
-    free(code->line_positions);
-    free(code->function_list->functions);
-    free(code->function_list);
-    free(code->constant_list->constants);
-    free(code->constant_list);
-    free(code->bytes);
-    free(code);
-}
+typedef struct {
+    int opt_level;
+    int jobs;
+    int disasm;
+    int watch;
+    int serve_port;
+    Run_Options run;
+} Options;
 
-void run(char *src) {
-    Token_List tokens = lex(src);
-    Code *code = compile(&tokens);
+void run(const char *src, size_t length, Options *options) {
+    Token_List tokens = lex(src, length);
 
 #ifdef PLEA_LEXER_DEBUG
-    for (int i = 0; i < tokens.count; i++) {
-        display_token(tokens.toks[i]);
+    for (size_t i = 0; token_at(&tokens, i).kind != T_EOF; i++) {
+        display_token(token_at(&tokens, i));
     }
 #endif
 
+    Code *code = compile(&tokens, options->opt_level, options->jobs);
+    free_tokens(&tokens);
+
 #ifdef PLEA_DEBUG
-    printf("%s", disassemble(code));
+    disassemble(code, stdout);
 #endif
 
 #if !defined(PLEA_LEXER_DEBUG) && !defined(PLEA_DEBUG)
-    run_bytecode(code);
+    if (options->disasm) {
+        verify(code);
+        disassemble(code, stdout);
+    }
+    else if (options->serve_port) {
+        serve(code, &options->run, options->serve_port, options->jobs);
+    }
+    else {
+        run_bytecode(code, &options->run);
+    }
 #endif
 
     free_code(code);
 }
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        printf("Usage: plea <file>\n");
+const char *map_source(const char *path, size_t *length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not find the file \"%s\"\n", path);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not read the file \"%s\"\n", path);
+        exit(1);
+    }
+
+    *length = (size_t)st.st_size;
+    const char *src = "";
+    if (*length > 0) {
+        src = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) {
+            fprintf(stderr, "Could not read the file \"%s\"\n", path);
+            exit(1);
+        }
+    }
+    close(fd);
+    return src;
+}
+
+double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Lexes the whole file over and over for about a second and reports the
+ * throughput of the fastest run */
+void bench_lex(const char *path) {
+    size_t length;
+    const char *src = map_source(path, &length);
+
+    double best = 0;
+    size_t count = 0;
+    for (double start = seconds(); seconds() - start < 1.0 || best == 0; ) {
+        double begin = seconds();
+        Token_List tokens = lex(src, length);
+        token_at(&tokens, (size_t)-1);
+        double elapsed = seconds() - begin;
+
+        count = tokens.count;
+        if (best == 0 || elapsed < best) best = elapsed;
+        free_tokens(&tokens);
+    }
+    printf("%zu bytes, %zu tokens: %.3f ms, %.1f MB/s\n", length, count, best * 1e3, length / best / 1e6);
+
+    if (length > 0) munmap((void *)src, length);
+}
+
+/* The whole file in memory, or NULL if it can't be read right now */
+char *read_source(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    size_t capacity = 4096;
+    char *src = plea_alloc(SITE_CODE, capacity);
+    *length = 0;
+    for (size_t n; (n = fread(src + *length, 1, capacity - *length, file)) > 0; ) {
+        *length += n;
+        if (*length == capacity) {
+            capacity *= 2;
+            src = plea_realloc(SITE_CODE, src, capacity);
+        }
+    }
+    fclose(file);
+    return src;
+}
+
+Code *compile_source(const char *src, size_t length, Options *options, Unit_Cache *cache) {
+    Token_List tokens = lex(src, length);
+    Code *code = compile_cached(&tokens, options->opt_level, options->jobs, cache);
+    free_tokens(&tokens);
+    return code;
+}
+
+/* Builds and runs the program in a child, so neither a compile error nor
+ * the program itself ends the watch. Once the child has compiled it says
+ * so on ready, and only then does the parent compile the same source
+ * too: it reuses the same functions and keeps the cache for the next
+ * build. */
+pid_t start_build(const char *path, Options *options, Unit_Cache *cache) {
+    size_t length;
+    char *src = read_source(path, &length);
+    if (!src) {
+        fprintf(stderr, "Could not read the file \"%s\"\n", path);
+        return -1;
+    }
+
+    int ready[2];
+    if (pipe(ready) != 0) {
+        fprintf(stderr, "Could not start the build\n");
         exit(1);
     }
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t child = fork();
+    if (child == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        close(ready[0]);
+        double start = seconds();
+        Code *code = compile_source(src, length, options, cache);
+        double elapsed = seconds() - start;
+
+        if (cache->count > 0) {
+            fprintf(stderr, "Compiled %d of %zu functions in %.3f ms\n", cache->compiled, cache->count, elapsed * 1e3);
+        }
+        else {
+            fprintf(stderr, "Compiled in %.3f ms\n", elapsed * 1e3);
+        }
+        ssize_t ok = write(ready[1], "", 1);
+        (void)ok;
+        close(ready[1]);
+
+        if (options->disasm) {
+            verify(code);
+            disassemble(code, stdout);
+        }
+        else {
+            run_bytecode(code, &options->run);
+        }
+        exit(0);
+    }
+
+    close(ready[1]);
+    char compiled;
+    if (child > 0 && read(ready[0], &compiled, 1) == 1) {
+        free_code(compile_source(src, length, options, cache));
+    }
+    close(ready[0]);
+    plea_free(src);
+    return child;
+}
+
+/* Blocks until name in the watched directory is written or replaced, then
+ * lets the rest of the editor's burst of events pass */
+void wait_for_change(int fd, const char *name) {
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } buffer;
 
-    FILE *f = fopen(argv[1], "rb");
+    for (int changed = 0; ; ) {
+        struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+        if (changed && poll(&poll_fd, 1, 50) <= 0) return;
 
-    if (!f) {
-        fprintf(stderr, "Could not find the file \"%s\"\n", argv[1]);
+        ssize_t length = read(fd, buffer.bytes, sizeof(buffer.bytes));
+        if (length <= 0) {
+            fprintf(stderr, "Could not watch for changes\n");
+            exit(1);
+        }
+        for (char *at = buffer.bytes; at < buffer.bytes + length; ) {
+            struct inotify_event *event = (struct inotify_event *)at;
+            if (event->len > 0 && strcmp(event->name, name) == 0) changed = 1;
+            at += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/* Rebuilds and reruns the program every time the file changes. The
+ * directory is watched rather than the file, so editors that save by
+ * renaming a new file over the old one are seen too. */
+void watch(const char *path, Options *options) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash+1 : path;
+    char *dir = plea_strdup(SITE_CODE, slash ? path : ".");
+    if (slash) dir[slash == path ? 1 : slash - path] = '\0';
+
+    int fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        fprintf(stderr, "Could not watch the file \"%s\"\n", path);
         exit(1);
     }
+    plea_free(dir);
 
-    fseek(f, 0, SEEK_END);
-    long length = ftell(f);
-    rewind(f);
+    Unit_Cache cache = {0};
+    for (;;) {
+        pid_t child = start_build(path, options, &cache);
+        wait_for_change(fd, name);
+        if (child > 0) {
+            kill(child, SIGTERM);
+            waitpid(child, NULL, 0);
+        }
+    }
+}
 
-    char *buffer = malloc(length + 1);
-    if (!buffer) {
-        fprintf(stderr, "Could not read the file \"%s\"\n", argv[1]);
+int main(int argc, char** argv) {
+    Options options = {
+        .opt_level = 1,
+        .jobs = 1,
+        .disasm = 0,
+        .watch = 0,
+        .serve_port = 0,
+        .run = {
+            .trace_path = NULL,
+            .deterministic = 0,
+            .seed = 0,
+            .clock = 12*60*60,
+            .replay_path = NULL,
+            .record_path = NULL,
+            .snapshot_path = NULL,
+            .snapshot_every = 0,
+            .restore_path = NULL,
+        },
+    };
+    char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9' && argv[i][3] == '\0') {
+            options.opt_level = argv[i][2] - '0';
+        }
+        else if (strcmp(argv[i], "-j") == 0) {
+            options.jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && atoi(argv[i] + 2) > 0) {
+            options.jobs = atoi(argv[i] + 2);
+        }
+        else if (strcmp(argv[i], "--disasm") == 0) {
+            options.disasm = 1;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            options.watch = 1;
+        }
+        else if (strncmp(argv[i], "--serve=", 8) == 0 && atoi(argv[i] + 8) > 0) {
+            options.serve_port = atoi(argv[i] + 8);
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            options.run.trace_path = "plea.trace";
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            options.run.trace_path = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--deterministic") == 0) {
+            options.run.deterministic = 1;
+        }
+        else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            options.run.deterministic = 1;
+            options.run.seed = (unsigned)strtoul(argv[i] + 7, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--clock=", 8) == 0) {
+            options.run.deterministic = 1;
+            options.run.clock = strtoll(argv[i] + 8, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            options.run.replay_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--record=", 9) == 0) {
+            options.run.record_path = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0) {
+            options.run.snapshot_path = "plea.snap";
+        }
+        else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            options.run.snapshot_path = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--snapshot-every=", 17) == 0 && atoll(argv[i] + 17) > 0) {
+            options.run.snapshot_every = atoll(argv[i] + 17);
+        }
+        else if (strncmp(argv[i], "--max-instructions=", 19) == 0 && atoll(argv[i] + 19) > 0) {
+            options.run.max_instructions = atoll(argv[i] + 19);
+        }
+        else if (strncmp(argv[i], "--restore=", 10) == 0) {
+            options.run.restore_path = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--hwcounters") == 0) {
+            options.run.hwcounters = 1;
+        }
+        else if (strcmp(argv[i], "--mem-profile") == 0) {
+            mem_profile_start(stderr);
+        }
+        else if (strcmp(argv[i], "--decode-trace") == 0 && i+1 < argc) {
+            trace_decode(argv[i+1]);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--bench-lex") == 0 && i+1 < argc) {
+            bench_lex(argv[i+1]);
+            return 0;
+        }
+        else if (!path) {
+            path = argv[i];
+        }
+        else {
+            path = NULL;
+            break;
+        }
+    }
+
+    if (!path) {
+        printf("Usage: plea [-O0|-O1|-O2] [-j[jobs]] [--disasm] [--watch] [--trace[=file]] <file>\n");
+        printf("            [--deterministic] [--seed=n] [--clock=unix time]\n");
+        printf("            [--replay=input file] [--record=input file] [--mem-profile] [--hwcounters]\n");
+        printf("            [--snapshot[=file]] [--snapshot-every=n] [--restore=snapshot file]\n");
+        printf("            [--max-instructions=n] [--serve=port]\n");
+        printf("       plea --decode-trace <trace file>\n");
+        printf("       plea --bench-lex <file>\n");
         exit(1);
     }
 
-    fread(buffer, 1, length, f);
-    fclose(f);
+    if (options.run.snapshot_every > 0 && !options.run.snapshot_path) options.run.snapshot_path = "plea.snap";
+
+    if (options.watch) {
+        watch(path, &options);
+        return 0;
+    }
+
+    size_t length;
+    const char *src = map_source(path, &length);
 
-    buffer[length] = '\0';
-    run(buffer);
+    run(src, length, &options);
 
-    free(buffer);
+    if (length > 0) munmap((void *)src, length);
 
     return 0;
 }
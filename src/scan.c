@@ -0,0 +1,132 @@
+#include <stdint.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+/* Bytes checked one at a time before handing a run to the vector loop;
+ * most tokens and gaps end within them */
+#define SCAN_SHORT 8
+
+/* Bit n set for the bytes in Scan_Class n. A NUL byte ends every run, as
+ * the lexer reads it as the end of the source. */
+uint8_t scan_classes[256];
+
+void scan_init_classes(void) {
+    scan_classes[' '] = scan_classes['\t'] = scan_classes['\n'] = scan_classes['\r'] = 1 << SCAN_SPACE;
+    for (int c = 1; c < 256; c++) {
+        int alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        int digit = c >= '0' && c <= '9';
+        if (alpha || digit || c == '_') scan_classes[c] |= 1 << SCAN_IDENT;
+        if (digit || c == '.') scan_classes[c] |= 1 << SCAN_NUMBER;
+        if (c != '\"' && c != '\n') scan_classes[c] |= 1 << SCAN_STRING;
+    }
+}
+
+size_t scan_while_scalar(const char *src, size_t pos, size_t len, Scan_Class class) {
+    while (pos < len && (scan_classes[(uint8_t)src[pos]] & (1 << class))) pos++;
+    return pos;
+}
+
+#ifdef SCAN_SIMD
+/* Unsigned lo <= c <= hi for each byte */
+static inline __m128i in_range_sse2(__m128i c, char lo, char hi) {
+    __m128i offset = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8((char)(hi - lo))), offset);
+}
+
+/* One bit for each of the 16 bytes, set if it is in class */
+static inline int scan_mask_sse2(__m128i c, Scan_Class class) {
+    __m128i in;
+    switch (class) {
+    case SCAN_SPACE:
+        in = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\t'))),
+                          _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))));
+        break;
+    case SCAN_IDENT:
+        in = _mm_or_si128(_mm_or_si128(in_range_sse2(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z'), in_range_sse2(c, '0', '9')),
+                          _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+        break;
+    case SCAN_NUMBER:
+        in = _mm_or_si128(in_range_sse2(c, '0', '9'), _mm_cmpeq_epi8(c, _mm_set1_epi8('.')));
+        break;
+    default:
+        in = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\"')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\n'))),
+                          _mm_cmpeq_epi8(c, _mm_setzero_si128()));
+        return ~_mm_movemask_epi8(in) & 0xffff;
+    }
+    return _mm_movemask_epi8(in);
+}
+
+size_t scan_while_sse2(const char *src, size_t pos, size_t len, Scan_Class class) {
+    for (; pos + 16 <= len; pos += 16) {
+        int out = ~scan_mask_sse2(_mm_loadu_si128((const __m128i *)&src[pos]), class) & 0xffff;
+        if (out) return pos + __builtin_ctz(out);
+    }
+    return scan_while_scalar(src, pos, len, class);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i in_range_avx2(__m256i c, char lo, char hi) {
+    __m256i offset = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8((char)(hi - lo))), offset);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned scan_mask_avx2(__m256i c, Scan_Class class) {
+    __m256i in;
+    switch (class) {
+    case SCAN_SPACE:
+        in = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t'))),
+                             _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r'))));
+        break;
+    case SCAN_IDENT:
+        in = _mm256_or_si256(_mm256_or_si256(in_range_avx2(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z'), in_range_avx2(c, '0', '9')),
+                             _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+        break;
+    case SCAN_NUMBER:
+        in = _mm256_or_si256(in_range_avx2(c, '0', '9'), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('.')));
+        break;
+    default:
+        in = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\"')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n'))),
+                             _mm256_cmpeq_epi8(c, _mm256_setzero_si256()));
+        return ~(unsigned)_mm256_movemask_epi8(in);
+    }
+    return (unsigned)_mm256_movemask_epi8(in);
+}
+
+__attribute__((target("avx2")))
+size_t scan_while_avx2(const char *src, size_t pos, size_t len, Scan_Class class) {
+    for (; pos + 32 <= len; pos += 32) {
+        unsigned out = ~scan_mask_avx2(_mm256_loadu_si256((const __m256i *)&src[pos]), class);
+        if (out) return pos + __builtin_ctz(out);
+    }
+    return scan_while_sse2(src, pos, len, class);
+}
+#endif
+
+static size_t (*scan_while_impl)(const char *, size_t, size_t, Scan_Class) = NULL;
+
+/* First position from pos on whose byte is not in class, or len. Runs are
+ * classified 32 or 16 bytes at a time where the CPU has AVX2 or SSE2; the
+ * last few bytes before len go one at a time so nothing past the source
+ * is read. */
+size_t scan_while(const char *src, size_t pos, size_t len, Scan_Class class) {
+    if (scan_while_impl == NULL) {
+        scan_init_classes();
+#ifdef SCAN_SIMD
+        scan_while_impl = __builtin_cpu_supports("avx2") ? scan_while_avx2 : scan_while_sse2;
+#else
+        scan_while_impl = scan_while_scalar;
+#endif
+    }
+
+    size_t end = len - pos > SCAN_SHORT ? pos + SCAN_SHORT : len;
+    for (; pos < end; pos++) {
+        if (!(scan_classes[(uint8_t)src[pos]] & (1 << class))) return pos;
+    }
+    return pos < len ? scan_while_impl(src, pos, len, class) : len;
+}
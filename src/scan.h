@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Runs of bytes the lexer skips over in one go */
+typedef enum {
+    SCAN_SPACE,
+    SCAN_IDENT,
+    SCAN_NUMBER,
+    SCAN_STRING,
+} Scan_Class;
+
+size_t scan_while(const char *src, size_t pos, size_t len, Scan_Class class);
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "PLEASNP"
+
+static volatile sig_atomic_t snapshot_signalled = 0;
+
+void snapshot_signal(int sig) {
+    (void)sig;
+    snapshot_signalled = 1;
+}
+
+/* The handler only sets a flag; the VM writes the snapshot at its next
+ * checkpoint, between two instructions */
+void snapshot_on_signal(void) {
+    signal(SIGUSR1, snapshot_signal);
+}
+
+int snapshot_requested(void) {
+    if (!snapshot_signalled) return 0;
+    snapshot_signalled = 0;
+    return 1;
+}
+
+uint32_t code_hash(Code *code) {
+    uint32_t hash = hash_bytes(2166136261u, code->bytes, code->count);
+    return hash_bytes(hash, code->constant_list->constants, code->constant_list->count * sizeof(Value));
+}
+
+/* Numbers the distinct arrays a run holds, in the order they are first
+ * seen. The table is sized for every slot to hold a different one. */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Array **slots;
+    uint32_t *ids;
+    Array **arrays;
+} Array_Ids;
+
+size_t array_slot(Array_Ids *ids, Array *array) {
+    size_t slot = (size_t)(((uintptr_t)array >> 4) * 2654435761u) & (ids->capacity-1);
+    while (ids->slots[slot] && ids->slots[slot] != array) slot = (slot+1) & (ids->capacity-1);
+    return slot;
+}
+
+void number_arrays(Array_Ids *ids, Value *from, Value *to) {
+    for (Value *value = from; value < to; value++) {
+        if (!value_is_array(*value)) continue;
+        size_t slot = array_slot(ids, value_as_array(*value));
+        if (ids->slots[slot]) continue;
+        ids->slots[slot] = value_as_array(*value);
+        ids->ids[slot] = (uint32_t)ids->count;
+        ids->arrays[ids->count++] = value_as_array(*value);
+    }
+}
+
+int write_values(FILE *f, Array_Ids *ids, Value *from, Value *to) {
+    for (Value *value = from; value < to; value++) {
+        uint64_t bits = value->bits;
+        if (value_is_array(*value)) bits = (uint64_t)ids->ids[array_slot(ids, value_as_array(*value))] << 3 | VALUE_ARRAY;
+        if (fwrite(&bits, sizeof(bits), 1, f) != 1) return 0;
+    }
+    return 1;
+}
+
+/* Written next to path and renamed over it, so a crash while writing
+ * leaves the last snapshot whole. Failing to write one is reported but
+ * does not stop the run. */
+void snapshot_write(const char *path, Vm *vm) {
+    Run_Options *options = vm->options;
+    int stack_count = (int)(vm->stack_ptr - vm->stack);
+    int return_count = (int)(vm->return_stack_ptr - vm->return_stack);
+
+    size_t holders = stack_count + return_count + vm->vars_count;
+    Array_Ids ids = { .count = 0, .capacity = 16 };
+    while (ids.capacity < 2*holders) ids.capacity *= 2;
+    ids.slots = plea_calloc(SITE_SNAPSHOT, ids.capacity, sizeof(Array *));
+    ids.ids = plea_alloc(SITE_SNAPSHOT, ids.capacity * sizeof(uint32_t));
+    ids.arrays = plea_alloc(SITE_SNAPSHOT, holders * sizeof(Array *));
+    number_arrays(&ids, vm->stack, vm->stack_ptr);
+    number_arrays(&ids, vm->vars, vm->vars + vm->vars_count);
+
+    When_Queue *when_queue = &vm->when_queue;
+    Snapshot_Header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .value_size = sizeof(Value),
+        .code_hash = code_hash(vm->code),
+        .cur_byte = vm->cur_byte,
+        .cur_function = vm->cur_function,
+        .scope = vm->scope,
+        .vars_count = vm->vars_count,
+        .stack_count = stack_count,
+        .return_count = return_count,
+        .array_count = (uint32_t)ids.count,
+        .when_count = (uint32_t)when_queue->count,
+        .when_dead = (uint32_t)when_queue->dead,
+        .executed = vm->executed,
+        .input_offset = options->input && options->input != stdin ? ftell(options->input) : -1,
+    };
+
+    /* Output up to here belongs to the state being saved */
+    fflush(options->output);
+
+    size_t length = strlen(path);
+    char *temp_path = plea_alloc(SITE_SNAPSHOT, length + 5);
+    memcpy(temp_path, path, length);
+    memcpy(temp_path + length, ".tmp", 5);
+
+    FILE *f = fopen(temp_path, "wb");
+    int ok = f != NULL && fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for (size_t i = 0; ok && i < ids.count; i++) {
+        uint32_t kind_len[2] = { ids.arrays[i]->kind, (uint32_t)ids.arrays[i]->len };
+        size_t size = ids.arrays[i]->len * array_elem_size(ids.arrays[i]->kind);
+        ok = fwrite(kind_len, sizeof(kind_len), 1, f) == 1
+            && fwrite(ids.arrays[i]->items.bytes, 1, size, f) == size;
+    }
+    for (int i = 0; ok && i <= vm->scope; i++) {
+        int32_t offset = (int32_t)(vm->frame_base[i] - vm->stack);
+        ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+    }
+    ok = ok && write_values(f, &ids, vm->stack, vm->stack_ptr)
+        && write_values(f, &ids, vm->return_stack, vm->return_stack_ptr)
+        && write_values(f, &ids, vm->vars, vm->vars + vm->vars_count);
+
+    size_t count = when_queue->count;
+    ok = ok && fwrite(when_queue->val1, sizeof(int32_t), count, f) == count
+        && fwrite(when_queue->val2, sizeof(int32_t), count, f) == count
+        && fwrite(when_queue->loc, sizeof(int32_t), count, f) == count
+        && fwrite(when_queue->mode, sizeof(int32_t), count, f) == count
+        && fwrite(when_queue->cond, sizeof(int32_t), count, f) == count
+        && fwrite(when_queue->is_promise, 1, count, f) == count;
+
+    if (f != NULL && fclose(f) != 0) ok = 0;
+    if (ok && rename(temp_path, path) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "Could not write the snapshot \"%s\"\n", path);
+        remove(temp_path);
+    }
+
+    plea_free(temp_path);
+    plea_free(ids.slots);
+    plea_free(ids.ids);
+    plea_free(ids.arrays);
+}
+
+void bad_snapshot(const char *path) {
+    fprintf(stderr, "\"%s\" is not a plea snapshot\n", path);
+    exit(1);
+}
+
+void read_exactly(FILE *f, void *data, size_t size, size_t count, const char *path) {
+    if (fread(data, size, count, f) != count) bad_snapshot(path);
+}
+
+/* Arrays start with no references and take one for each slot read */
+void read_values(FILE *f, Array **arrays, uint32_t array_count, Value *to, int count, const char *path) {
+    for (int i = 0; i < count; i++) {
+        uint64_t bits;
+        read_exactly(f, &bits, sizeof(bits), 1, path);
+        if ((bits & VALUE_TAG_MASK) == VALUE_ARRAY) {
+            if ((bits >> 3) >= array_count) bad_snapshot(path);
+            Array *array = arrays[bits >> 3];
+            array->refs++;
+            to[i] = value_array(array);
+        }
+        else {
+            to[i] = (Value){ .bits = bits };
+        }
+    }
+}
+
+/* Loads a snapshot into a new VM, which has an empty when queue and no
+ * variables yet */
+void snapshot_read(const char *path, Vm *vm) {
+    Code *code = vm->code;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not find the file \"%s\"\n", path);
+        exit(1);
+    }
+
+    Snapshot_Header header;
+    read_exactly(f, &header, sizeof(header), 1, path);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header.value_size != sizeof(Value)) {
+        bad_snapshot(path);
+    }
+    if (header.code_hash != code_hash(code)) {
+        fprintf(stderr, "The snapshot \"%s\" was taken of a different program\n", path);
+        exit(1);
+    }
+    if (header.scope < -1 || header.scope >= MAX_SCOPE
+        || header.vars_count < 256 || header.vars_count > (MAX_SCOPE+1)*256 || header.vars_count % 256 != 0
+        || header.stack_count < 0 || header.stack_count > STACK_SIZE
+        || header.return_count < 0 || header.return_count > RETURN_STACK_SIZE
+        || header.cur_byte < 0 || (size_t)header.cur_byte >= code->count
+        || header.cur_function < 0 || (size_t)header.cur_function >= code->function_list->count) {
+        bad_snapshot(path);
+    }
+
+    Array **arrays = plea_alloc(SITE_SNAPSHOT, header.array_count * sizeof(Array *));
+    for (uint32_t i = 0; i < header.array_count; i++) {
+        uint32_t kind_len[2];
+        read_exactly(f, kind_len, sizeof(kind_len), 1, path);
+        if (kind_len[0] > ARRAY_CHAR) bad_snapshot(path);
+        arrays[i] = array_new(kind_len[0], kind_len[1]);
+        arrays[i]->refs = 0;
+        read_exactly(f, arrays[i]->items.bytes, array_elem_size(kind_len[0]), kind_len[1], path);
+    }
+
+    for (int i = 0; i <= header.scope; i++) {
+        int32_t offset;
+        read_exactly(f, &offset, sizeof(offset), 1, path);
+        if (offset < 0 || offset > header.stack_count) bad_snapshot(path);
+        vm->frame_base[i] = vm->stack + offset;
+    }
+    read_values(f, arrays, header.array_count, vm->stack, header.stack_count, path);
+    read_values(f, arrays, header.array_count, vm->return_stack, header.return_count, path);
+    vm->vars = plea_alloc(SITE_SCOPES, header.vars_count * sizeof(Value));
+    read_values(f, arrays, header.array_count, vm->vars, header.vars_count, path);
+
+    /* Added as they were, dead entries too, so the queue keeps its order */
+    for (uint32_t i = 0; i < header.when_count; i++) when_queue_add(&vm->when_queue, 0, 0, 0, 0, 0, 0);
+    When_Queue *when_queue = &vm->when_queue;
+    size_t count = header.when_count;
+    read_exactly(f, when_queue->val1, sizeof(int32_t), count, path);
+    read_exactly(f, when_queue->val2, sizeof(int32_t), count, path);
+    read_exactly(f, when_queue->loc, sizeof(int32_t), count, path);
+    read_exactly(f, when_queue->mode, sizeof(int32_t), count, path);
+    read_exactly(f, when_queue->cond, sizeof(int32_t), count, path);
+    read_exactly(f, when_queue->is_promise, 1, count, path);
+    when_queue->dead = header.when_dead;
+    fclose(f);
+
+    vm->stack_ptr = vm->stack + header.stack_count;
+    vm->return_stack_ptr = vm->return_stack + header.return_count;
+    vm->vars_count = header.vars_count;
+    vm->scope = header.scope;
+    vm->cur_byte = header.cur_byte;
+    vm->cur_function = header.cur_function;
+
+    vm->executed = header.executed;
+    FILE *input = vm->options->input;
+    if (header.input_offset >= 0 && input && input != stdin) fseek(input, header.input_offset, SEEK_SET);
+    plea_free(arrays);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/* Followed by the arrays, the frame bases as stack offsets, the stack, the
+ * return stack, the variables and the when queue columns. Values that hold
+ * an array store its index in the snapshot in place of the pointer. */
+typedef struct {
+    char magic[8];
+    uint32_t value_size;
+    uint32_t code_hash;
+    int32_t cur_byte;
+    int32_t cur_function;
+    int32_t scope;
+    int32_t vars_count;
+    int32_t stack_count;
+    int32_t return_count;
+    uint32_t array_count;
+    uint32_t when_count;
+    uint32_t when_dead;
+    uint32_t padding;
+    int64_t executed;
+    int64_t input_offset;
+} Snapshot_Header;
+
+void snapshot_on_signal(void);
+int snapshot_requested(void);
+void snapshot_write(const char *path, Vm *vm);
+void snapshot_read(const char *path, Vm *vm);
@@ -0,0 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "vm.h"
+
+#define TRACE_MAGIC "PLEATRC"
+
+static Trace_Event trace_ring[TRACE_EVENTS];
+static uint64_t trace_count = 0;
+static int trace_fd = -1;
+
+void trace_signal(int sig) {
+    trace_dump();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* The file is opened up front so the dump on a crash only has to write(). */
+void trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "Could not open the trace file \"%s\"\n", path);
+        exit(1);
+    }
+
+    atexit(trace_dump);
+    int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM };
+    for (unsigned i = 0; i < sizeof(signals)/sizeof(signals[0]); i++) {
+        signal(signals[i], trace_signal);
+    }
+}
+
+void trace_record(int offset, uint8_t op, int top, int scope, int depth) {
+    trace_ring[trace_count & (TRACE_EVENTS-1)] = (Trace_Event){
+        .offset = (uint32_t)offset,
+        .top = top,
+        .depth = (uint16_t)depth,
+        .op = op,
+        .scope = (int8_t)scope,
+    };
+    trace_count++;
+}
+
+/* Writes the header and the kept events oldest first. Only uses write(), so
+ * it is safe to call from the signal handler. */
+void trace_dump(void) {
+    if (trace_fd < 0) return;
+    int fd = trace_fd;
+    trace_fd = -1;
+
+    Trace_Header header = {
+        .magic = TRACE_MAGIC,
+        .event_size = sizeof(Trace_Event),
+        .capacity = TRACE_EVENTS,
+        .count = trace_count,
+    };
+    size_t head = trace_count & (TRACE_EVENTS-1);
+
+    ssize_t ok = write(fd, &header, sizeof(header));
+    if (trace_count > TRACE_EVENTS) {
+        ok = write(fd, &trace_ring[head], (TRACE_EVENTS-head) * sizeof(Trace_Event));
+    }
+    ok = write(fd, trace_ring, head * sizeof(Trace_Event));
+    (void)ok;
+    close(fd);
+}
+
+void trace_decode(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not find the file \"%s\"\n", path);
+        exit(1);
+    }
+
+    Trace_Header header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || header.event_size != sizeof(Trace_Event)) {
+        fprintf(stderr, "\"%s\" is not a plea trace\n", path);
+        exit(1);
+    }
+
+    uint64_t kept = header.count < header.capacity ? header.count : header.capacity;
+    printf("%llu instructions traced, last %llu kept\n", (unsigned long long)header.count, (unsigned long long)kept);
+    printf("%12s %8s  %-13s %11s %5s %5s\n", "seq", "offset", "op", "top", "scope", "depth");
+
+    Trace_Event event;
+    for (uint64_t seq = header.count - kept; fread(&event, sizeof(event), 1, f) == 1; seq++) {
+        char *name = op_name(event.op);
+        printf("%12llu %8u  %-13s %11d %5d %5u\n", (unsigned long long)seq, event.offset,
+               name ? name : "?", event.top, event.scope, event.depth);
+    }
+    fclose(f);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#define TRACE_EVENTS 65536
+
+/* One dispatched instruction: where, which opcode, the value on top of the
+ * stack before it ran, the scope and the stack depth. */
+typedef struct {
+    uint32_t offset;
+    int32_t top;
+    uint16_t depth;
+    uint8_t op;
+    int8_t scope;
+} Trace_Event;
+
+typedef struct {
+    char magic[8];
+    uint32_t event_size;
+    uint32_t capacity;
+    uint64_t count;
+} Trace_Header;
+
+void trace_open(const char *path);
+void trace_record(int offset, uint8_t op, int top, int scope, int depth);
+void trace_dump(void);
+void trace_decode(const char *path);
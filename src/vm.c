@@ -1,108 +1,242 @@
-#include <assert.h>
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <stdarg.h>
 
+#include "alloc.h"
+#include "hwcounters.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "vm.h"
 
-#define MAX_SCOPE 16
+/* Instructions run between checkpoints when nothing needs one sooner */
+#define CHECK_INTERVAL 65536
+
+Value *allocate_scope(Value *vars, int scope) {
+    vars = plea_realloc(SITE_SCOPES, vars, (scope+1)*256*sizeof(Value));
+    memset(vars + scope*256, 0, 256*sizeof(Value));
+    return vars;
+}
+
+size_t array_elem_size(Array_Kind kind) {
+    return kind == ARRAY_CHAR ? sizeof(uint8_t) : sizeof(Value32);
+}
+
+Array *array_new(Array_Kind kind, size_t len) {
+    Array *array = plea_alloc(SITE_ARRAYS, sizeof(Array));
+    array->len = len;
+    array->kind = kind;
+    array->refs = 1;
+    array->items.bytes = plea_alloc(SITE_ARRAY_ITEMS, len * array_elem_size(kind));
+    return array;
+}
+
+void array_resize(Array *array, size_t len) {
+    array->len = len;
+    array->items.bytes = plea_realloc(SITE_ARRAY_ITEMS, array->items.bytes, len * array_elem_size(array->kind));
+}
 
-void sb_append(String_Builder *sb, char *str) {
-    sb->count += strlen(str);
-    while (sb->count > sb->capacity) {
-        sb->capacity *= 2;
-        sb->string = realloc(sb->string, sb->capacity * sizeof(char));
-        assert(sb->string != NULL);
+void array_free(Array *array) {
+    plea_free(array->items.bytes);
+    plea_free(array);
+}
+
+void value_retain(Value value) {
+    if (value_is_array(value)) value_as_array(value)->refs++;
+}
+
+void value_release(Value value) {
+    if (value_is_array(value) && --value_as_array(value)->refs == 0) array_free(value_as_array(value));
+}
+
+/* Stores value, whose reference the slot takes over, in place of the one
+ * it held */
+void set_var(Value *slot, Value value) {
+    value_release(*slot);
+    *slot = value;
+}
+
+/* Lets go of the arrays held in from up to to. Other slots are left as
+ * they are: nothing reads them again before they are written. */
+void release_values(Value *from, Value *to) {
+    uint64_t tags = 0;
+    for (Value *value = from; value < to; value++) tags |= value->bits;
+    if (!(tags & VALUE_ARRAY)) return;
+
+    for (Value *value = from; value < to; value++) {
+        if (!value_is_array(*value)) continue;
+        value_release(*value);
+        *value = value_int(0);
     }
-    strcat(sb->string, str);
 }
 
-void sb_appendf(String_Builder *sb, char *format, ...) {
-    va_list args;
-    va_start(args, format);
+int array_get(Array *array, int index) {
+    if (array->kind == ARRAY_CHAR) return array->items.bytes[index];
+    return array->items.words[index].integer;
+}
 
-    int needed_size = vsnprintf(NULL, 0, format, args);
-    va_end(args);
+void array_set(Array *array, int index, int val) {
+    if (array->kind == ARRAY_CHAR) array->items.bytes[index] = (uint8_t)val;
+    else array->items.words[index].integer = val;
+}
 
-    while (sb->count + needed_size + 1 > sb->capacity) {
-        sb->capacity *= 2;
-        sb->string = realloc(sb->string, sb->capacity * sizeof(char));
-        assert(sb->string != NULL);
+void array_fill(Array *array, int lo, int hi, int val) {
+    if (array->kind == ARRAY_CHAR) {
+        memset(array->items.bytes + lo, (uint8_t)val, hi - lo);
+    }
+    else {
+        for (int i = lo; i < hi; i++) array->items.words[i].integer = val;
     }
-    va_start(args, format);
-    vsnprintf(sb->string + sb->count, needed_size + 1, format, args);
-    sb->count += needed_size;
-    va_end(args);
 }
 
-Value *allocate_scope(Value *vars, int scope) {
-    vars = realloc(vars, (scope+1)*256*sizeof(Value));
-    assert(vars != NULL);
-    memset(vars + scope*256, 0, 256*sizeof(Value));
-    return vars;
+void array_copy(Array *dst, Array *src, int lo, int hi) {
+    if (dst == src) return;
+    if (dst->kind == src->kind || (dst->kind != ARRAY_CHAR && src->kind != ARRAY_CHAR)) {
+        size_t size = array_elem_size(dst->kind);
+        memmove(dst->items.bytes + lo*size, src->items.bytes + lo*size, (hi - lo)*size);
+    }
+    else {
+        for (int i = lo; i < hi; i++) array_set(dst, i, array_get(src, i));
+    }
 }
 
-void when_queue_add(When_Queue *when_queue, uint8_t cond, int val1, int val2, int loc, uint8_t mode, uint8_t is_promise) {
-    if (when_queue->count == when_queue->capacity) {
-        when_queue->capacity *= 2;
-        when_queue->whens = realloc(when_queue->whens, when_queue->capacity * sizeof(When));
-        assert(when_queue->whens != NULL);
+int array_mismatch(Array *a, Array *b, int lo, int hi, int step) {
+    if (step > 0 && a->kind == b->kind) {
+        size_t size = array_elem_size(a->kind);
+        while (hi - lo >= 64 && memcmp(a->items.bytes + lo*size, b->items.bytes + lo*size, 64*size) == 0) lo += 64;
     }
-    when_queue->whens[when_queue->count] = (When){
-        .cond = cond,
-        .val1 = val1,
-        .val2 = val2,
-        .loc = loc,
-        .mode = mode,
-        .is_promise = is_promise
-    };
-    when_queue->count++;
+
+    for (int n = hi - lo, i = step > 0 ? lo : hi - 1; n > 0; n--, i += step) {
+        if (array_get(a, i) != array_get(b, i)) return i;
+    }
+    return -1;
 }
 
-void push(Value **stack_ptr, Value val, int type) {
-#ifdef PLEA_DEBUG
-    printf("(%d)", val.as.integer);
-#endif
+int when_references(When_Queue *when_queue, size_t i, int slot) {
+    return ((when_queue->mode[i] & 1) && when_queue->val1[i] == slot) || ((when_queue->mode[i] & 2) && when_queue->val2[i] == slot);
+}
+
+void run_bulk_loop(Code *code, int pos, Value *vars, int scope, When_Queue *when_queue, int function_location) {
+    int iv = code->bytes[pos+1];
+    int step = code->bytes[pos+2] ? -1 : 1;
+    int count = code->bytes[pos+3];
+    uint8_t *descs = &code->bytes[pos+4];
+
+    /* Whens read unscoped slots, so only main's frame lines up with the guard */
+    if (scope != 0) return;
+
+    int guard = -1;
+    for (size_t i = 0; i < when_queue->count; i++) {
+        if (when_queue->cond[i] == -1) continue;
+        for (int d = 0; d < count; d++) {
+            if (descs[d*3] == BULK_LOAD && when_references(when_queue, i, descs[d*3+1])) return;
+        }
+        if (!when_references(when_queue, i, iv)) continue;
+        if (guard != -1 || when_queue->cond[i] != 1 || when_queue->loc[i] < function_location) return;
+        guard = (int)i;
+    }
+    if (guard == -1) return;
+
+    int limit;
+    int mode = when_queue->mode[guard];
+    if (mode & WHEN_REAL) return;
+    if ((mode & 1) && when_queue->val1[guard] == iv) {
+        if ((mode & 2) && when_queue->val2[guard] == iv) return;
+        limit = (mode & 2) ? value_as_int(vars[when_queue->val2[guard]]) : when_queue->val2[guard];
+    }
+    else {
+        limit = (mode & 1) ? value_as_int(vars[when_queue->val1[guard]]) : when_queue->val1[guard];
+    }
+
+    int first = value_as_int(vars[iv]);
+    if (step > 0 ? first >= limit : first <= limit) return;
+    int lo = step > 0 ? first : limit + 1;
+    int hi = step > 0 ? limit : first + 1;
+    if (lo < 0) return;
+
+    for (int d = 0; d < count; d++) {
+        int arrays[2] = { descs[d*3+1], descs[d*3] == BULK_COPY ? descs[d*3+2] : -1 };
+        if (descs[d*3] == BULK_LOAD) arrays[0] = descs[d*3+2];
+        if (descs[d*3] == BULK_UNTIL_NE) continue;
+
+        for (int j = 0; j < 2 && arrays[j] != -1; j++) {
+            if (!value_is_array(vars[arrays[j]]) || value_as_array(vars[arrays[j]])->len < (size_t)hi) return;
+        }
+    }
+
+    if (descs[count*3-3] == BULK_UNTIL_NE) {
+        Array *a = value_as_array(vars[descs[2]]);
+        Array *b = value_as_array(vars[descs[5]]);
+        int mismatch = array_mismatch(a, b, lo, hi, step);
+        if (mismatch != -1) {
+            vars[iv] = value_int(mismatch);
+            return;
+        }
+        int last = step > 0 ? hi - 1 : lo;
+        vars[descs[1]] = value_int(array_get(a, last));
+        vars[descs[4]] = value_int(array_get(b, last));
+        vars[iv] = value_int(limit);
+        return;
+    }
+
+    for (int d = 0; d < count; d++) {
+        Array *dst = value_as_array(vars[descs[d*3+1]]);
+        switch (descs[d*3]) {
+        case BULK_FILL_IMM:   array_fill(dst, lo, hi, descs[d*3+2]); break;
+        case BULK_FILL_CONST: array_fill(dst, lo, hi, value_as_int(code->constant_list->constants[descs[d*3+2]])); break;
+        case BULK_FILL_VAR:   array_fill(dst, lo, hi, value_as_int(vars[descs[d*3+2]])); break;
+        case BULK_COPY:       array_copy(dst, value_as_array(vars[descs[d*3+2]]), lo, hi); break;
+        default: break;
+        }
+    }
+    vars[iv] = value_int(limit);
+}
+
+void push(Value **stack_ptr, Value val) {
     **stack_ptr = val;
-    (*stack_ptr)->type = type;
     (*stack_ptr)++;
 }
 
-void push_p(Value **stack_ptr, uintptr_t val) {
-#ifdef PLEA_DEBUG
-    printf("(%p)", (Array *)val);
-#endif
-    (*stack_ptr)->type = 2;
-    (*stack_ptr)->as.pointer = val;
+void push_p(Value **stack_ptr, Array *val) {
+    **stack_ptr = value_array(val);
     (*stack_ptr)++;
 }
 
 void push_i(Value **stack_ptr, int val) {
-#ifdef PLEA_DEBUG
-    printf("(%d)", val);
-#endif
-    (*stack_ptr)->type = 0;
-    (*stack_ptr)->as.integer = val;
+    **stack_ptr = value_int(val);
     (*stack_ptr)++;
 }
 
 Value pop(Value **stack_ptr) {
     (*stack_ptr)--;
     Value val = **stack_ptr;
-    (*stack_ptr)->as.integer = 0;
-    (*stack_ptr)->type = 0;
+    **stack_ptr = value_int(0);
     return val;
 }
 
+int pop_i(Value **stack_ptr) {
+    return value_as_int(pop(stack_ptr));
+}
+
+void push_r(Value **stack_ptr, float val) {
+    **stack_ptr = value_real(val);
+    (*stack_ptr)++;
+}
+
+float pop_r(Value **stack_ptr) {
+    return value_as_real(pop(stack_ptr));
+}
+
 uint8_t consume_byte(Code *code, int *cur_byte) {
     (*cur_byte)++;
     return code->bytes[*cur_byte];
 }
 
-void check_beg_text(char *beg_text);
+int check_beg_text(const char *beg_text, Run_Options *options);
 
 void skip_instruction(Code *code, int *cur_byte) {
     switch (code->bytes[*cur_byte]) {
@@ -114,6 +248,8 @@ void skip_instruction(Code *code, int *cur_byte) {
     case OP_JMPBSI:
     case OP_CONST: *cur_byte += 2;   break;
     case OP_INC:
+    case OP_INC_F:
+    case OP_DEC_F:
     case OP_POP:
     case OP_POPR:
     case OP_JMPBS:
@@ -129,557 +265,811 @@ void skip_instruction(Code *code, int *cur_byte) {
     case OP_FNCTN:
     case OP_BEG:
     case OP_CALL:
+    case OP_TAILCALL:
         while (code->bytes[*cur_byte] != '\0') (*cur_byte)++;
         break;
     default: fprintf(stderr, "Unknown instruction: %d\n", code->bytes[*cur_byte]); exit(1);
     }
 }
 
-void disassemble_byte(uint8_t byte, int cur_byte);
+int find_function(Code *code, char *name) {
+    for (unsigned i = 0; i < code->function_list->count; i++) {
+        if (strcmp(name, code->function_list->functions[i].name) == 0) return i;
+    }
+    return -1;
+}
 
-void run_bytecode(Code *code) {
-    Value return_stack[256];
-    Value stack[1024];
-    Value *vars = calloc(256, sizeof(Value));
+/* Where the function's body starts, or -1 for a main that does not open
+ * by calling itself */
+int enter_function(Code *code, int function) {
+    int cur_byte = code->function_list->functions[function].location;
+    if (strcmp(code->function_list->functions[function].name, "main") == 0) {
+        if (code->bytes[cur_byte] != OP_CALL) return -1;
+        consume_byte(code, &cur_byte);
+        if (strcmp((char *)&code->bytes[cur_byte], "main") != 0) return -1;
 
-    When_Queue when_queue = (When_Queue){
-        .count = 0,
-        .capacity = 4,
-        .whens = malloc(4 * sizeof(When))
-    };
+        while (code->bytes[cur_byte] != 0) {
+            consume_byte(code, &cur_byte);
+        }
+        consume_byte(code, &cur_byte);
+    }
+    return cur_byte;
+}
 
-    Value *stack_ptr = stack;
-    Value *return_stack_ptr = return_stack;
+int check_promises(Code *code, When_Queue *when_queue, int cur_function, int cur_byte) {
+    for (size_t i = 0; i < when_queue->count; i++) {
+        if (when_queue->cond[i] == -1 || when_queue->loc[i] < code->function_list->functions[cur_function].location) continue;
 
-    int vars_count = 256;
-    int scope = -1;
-    int cur_byte = 0;
-    if (code->bytes[cur_byte] != OP_BEG) {
-        fprintf(stderr, "Programmer has insufficiently begged\n");
-        exit(1);
+        if (when_queue->is_promise[i]) {
+            fprintf(stderr, "%d: You promised :(\n", source_line(code, cur_byte));
+            return 0;
+        }
     }
+    return 1;
+}
 
-    int cur_function = 0;
-    while (code->bytes[cur_byte] != OP_HLT) {
-        switch (code->bytes[cur_byte]) {
-        case OP_CONST:
-            push(&stack_ptr, code->constant_list->constants[consume_byte(code, &cur_byte)], 0);
-            consume_byte(code, &cur_byte);
-            break;
-        case OP_INC:
-            push_i(&stack_ptr, pop(&stack_ptr).as.integer+1);
-            consume_byte(code, &cur_byte);
-            break;
-        case OP_DEC:
-            push_i(&stack_ptr, pop(&stack_ptr).as.integer-1);
-            consume_byte(code, &cur_byte);
-            break;
-        case OP_SET_VAR: {
-            int index = consume_byte(code, &cur_byte) + scope*256;
-            int val = consume_byte(code, &cur_byte);
-            vars[index].as.integer = val;
-            vars[index].type = 0;
-            consume_byte(code, &cur_byte);
-            break;
+void stack_effect(Code *code, int pos, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (code->bytes[pos]) {
+    case OP_CONST:
+    case OP_PUSH:
+    case OP_PUSHI:
+    case OP_INPUT: *pushes = 1; break;
+    case OP_INC:
+    case OP_DEC:
+    case OP_INC_F:
+    case OP_DEC_F: *pops = 1; *pushes = 1; break;
+    case OP_POP:
+    case OP_DROP:
+    case OP_JMP:
+    case OP_JMPB:
+    case OP_JMPS:
+    case OP_JMPBS: *pops = 1; break;
+    case OP_SET_LEN: *pops = 2; break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_ADD_F:
+    case OP_SUB_F:
+    case OP_SETP_LEN:
+    case OP_PUSH_INDEX:
+    case OP_PUSH_INDEX_I:
+    case OP_PUSH_INDEX_C: *pops = 2; *pushes = 1; break;
+    case OP_SET_INDEX:
+    case OP_SET_INDEX_I:
+    case OP_SET_INDEX_C:
+    case OP_WHEN:
+    case OP_WHEN_NOT:
+    case OP_PROMISE:
+    case OP_PROMISE_NOT:
+    case OP_TEST:
+    case OP_TEST_NOT:
+    case OP_TEST_F:
+    case OP_TEST_NOT_F: *pops = 3; break;
+    case OP_SETP_INDEX:
+    case OP_SETP_INDEX_I:
+    case OP_SETP_INDEX_C: *pops = 3; *pushes = 1; break;
+    case OP_CALL:
+        if (find_function(code, (char *)&code->bytes[pos+1]) == -1) {
+            *pops = 1;
+            *pushes = 1;
         }
-        case OP_PUSH: {
-            int index = consume_byte(code, &cur_byte) + scope*256;
-            push(&stack_ptr, vars[index], vars[index].type);
-            consume_byte(code, &cur_byte);
-            break;
+        break;
+    case OP_TAILCALL: {
+        int function = find_function(code, (char *)&code->bytes[pos+1]);
+        if (function != -1) *pops = code->function_list->functions[function].stack_args;
+        break;
+    }
+    default: break;
+    }
+}
+
+/* Instructions after which the unchecked loop tests its headroom */
+int is_transfer(Code *code, int pos) {
+    switch (code->bytes[pos]) {
+    case OP_CALL: return find_function(code, (char *)&code->bytes[pos+1]) != -1;
+    case OP_TAILCALL:
+    case OP_RET:
+    case OP_RETS:
+    case OP_JMP:
+    case OP_JMPB:
+    case OP_JMPS:
+    case OP_JMPBS: return 1;
+    default: return 0;
+    }
+}
+
+int verify_fail(int pos, const char *why) {
+#ifdef PLEA_DEBUG
+    printf("verify: %s at %d, running checked\n", why, pos);
+#else
+    (void)pos;
+    (void)why;
+#endif
+    return -1;
+}
+
+/* Checks compiled code once before it runs: opcodes are known, operands
+ * stay inside the code and the constant pool, calls resolve and every jump
+ * lands on an instruction. Loops are line jumps, so no total depth is
+ * worked out; instead each function records the most any stretch of it
+ * between two transfers can push. The largest of those is returned as the
+ * headroom the unchecked loop tests at each transfer, or -1 when the code
+ * has to run checked. */
+int verify(Code *code) {
+    int count = (int)code->count;
+    Function_List *functions = code->function_list;
+    Line_Pos_List *lines = code->line_positions;
+
+    uint8_t *starts = plea_calloc(SITE_PASSES, count, 1);
+    int pos = 0;
+    while (pos < count) {
+        int length = instruction_length(code, pos);
+        if (length == 0 || op_name(code->bytes[pos]) == NULL) {
+            plea_free(starts);
+            return verify_fail(pos, "unknown or truncated instruction");
         }
-        case OP_PUSHI:
-            push_i(&stack_ptr, consume_byte(code, &cur_byte));
-            consume_byte(code, &cur_byte);
-            break;
-        case OP_POP:
-            vars[consume_byte(code, &cur_byte) + scope*256] = pop(&stack_ptr);
-            consume_byte(code, &cur_byte);
+        starts[pos] = 1;
+        pos += length;
+    }
+
+    int result = -1;
+    for (unsigned i = 0; i < functions->count; i++) {
+        if (functions->functions[i].location >= count || !starts[functions->functions[i].location]) {
+            result = verify_fail(functions->functions[i].location, "function body outside the code");
+            goto done;
+        }
+    }
+
+    int headroom = 0;
+    int function = -1;
+    int growth = 0;
+    int peak = 0;
+    int known = 0;
+    int has_known = 0;
+    unsigned line = 0;
+    uint8_t last = OP_HLT;
+    for (pos = 0; pos < count; pos += instruction_length(code, pos)) {
+        uint8_t op = code->bytes[pos];
+        uint8_t operand = pos+1 < count ? code->bytes[pos+1] : 0;
+        char *name = (char *)&code->bytes[pos+1];
+        last = op;
+
+        /* A known jump target only holds within the line that pushed it */
+        for (; line < lines->count && lines->positions[line] <= pos; line++) has_known = 0;
+
+        int next_known = 0;
+        int next_has_known = 0;
+        switch (op) {
+        case OP_FNCTN:
+            if (function != -1) functions->functions[function].max_depth = peak;
+            if (peak > headroom) headroom = peak;
+            function = find_function(code, name);
+            growth = 0;
+            peak = 0;
             break;
-        case OP_CALL:
-            consume_byte(code, &cur_byte);
-            char *func_name = (char *)&code->bytes[cur_byte];
-            for (unsigned i = 0; i < code->function_list->count; i++) {
-                if (strcmp(func_name, code->function_list->functions[i].name) == 0) {
-                    while (code->bytes[cur_byte] != 0) {
-                        consume_byte(code, &cur_byte);
-                    }
-                    consume_byte(code, &cur_byte);
-
-                    push_i(&return_stack_ptr, cur_byte);
-                    cur_byte = code->function_list->functions[i].location;
-                    cur_function = i;
-
-                    scope++;
-                    vars = allocate_scope(vars, scope);
-                    vars_count = (scope+1)*256;
-                    if (scope >= MAX_SCOPE) {
-                        fprintf(stderr, "The scope is too deep\n");
-                        exit(1);
-                    }
-
-                    if (strcmp(func_name, "main") == 0) {
-                        if (code->bytes[cur_byte] != OP_CALL) exit(1);
-                        consume_byte(code, &cur_byte);
-                        if (strcmp((char *)&code->bytes[cur_byte], "main") != 0) exit(1);
-
-                        while (code->bytes[cur_byte] != 0) {
-                            consume_byte(code, &cur_byte);
-                        }
-                        consume_byte(code, &cur_byte);
-                    }
-                    break;
-                }
-                if (i == code->function_list->count - 1) {
-                    if (strcmp(func_name, "print") == 0) {
-                        Value v = pop(&stack_ptr);
-                        if (v.type != 2) {
-                            char c = (char)v.as.integer;
-                            printf("%c", c);
-                            push_i(&stack_ptr, c);
-                        }
-                        else {
-                            Array *char_array = (Array *)v.as.pointer;
-                            for (unsigned j = 0; j < char_array->len; j++) {
-                                printf("%c", char_array->items[j].integer);
-                            }
-                            push_p(&stack_ptr, (uintptr_t)char_array);
-                        }
-
-                        while (code->bytes[cur_byte] != 0) {
-                            consume_byte(code, &cur_byte);
-                        }
-                        consume_byte(code, &cur_byte);
-                    }
-                }
+        case OP_CONST:
+            if (operand >= code->constant_list->count) {
+                result = verify_fail(pos, "constant out of range");
+                goto done;
             }
+            next_known = value_as_int(code->constant_list->constants[operand]);
+            next_has_known = 1;
             break;
-        case OP_RET:
-            for (unsigned i = 0; i < when_queue.count; i++) {
-                if (when_queue.whens[i].cond == -1) continue;
-                if (when_queue.whens[i].loc < code->function_list->functions[cur_function].location ||
-                    (code->function_list->count-cur_function <= 0 && when_queue.whens[i].loc >= code->function_list->functions[cur_function+1].location))
-                    continue;
-
-                if (when_queue.whens[i].is_promise) {
-                    fprintf(stderr, "You promised :(\n");
-                    exit(1);
-                }
-            }
-
-            cur_byte = pop(&return_stack_ptr).as.integer;
-            scope--;
+        case OP_PUSHI:
+            next_known = operand;
+            next_has_known = 1;
             break;
-        case OP_RETS:
-            cur_byte = pop(&return_stack_ptr).as.integer;
+        case OP_INC:
+        case OP_DEC:
+            next_known = known + (op == OP_INC ? 1 : -1);
+            next_has_known = has_known;
             break;
-        case OP_BEG:
-            check_beg_text((char *)&code->bytes[cur_byte+1]);
-            while (code->bytes[cur_byte] != 0) {
-                consume_byte(code, &cur_byte);
-            }
-            consume_byte(code, &cur_byte);
+        case OP_POPR:
+            next_known = known;
+            next_has_known = has_known;
             break;
-        case OP_FNCTN:
-            while (code->bytes[cur_byte] != 0) {
-                consume_byte(code, &cur_byte);
+        case OP_SET_ARRAY:
+            if (code->bytes[pos+2] > ARRAY_CHAR) {
+                result = verify_fail(pos, "bad array kind");
+                goto done;
             }
-            consume_byte(code, &cur_byte);
             break;
-        case OP_INPUT: {
-            vars[vars_count-1].type = 2;
-            vars[vars_count-1].as.pointer = (uintptr_t)malloc(sizeof(Array));
-            ((Array *)vars[vars_count-1].as.pointer)->len = 64;
-            ((Array *)vars[vars_count-1].as.pointer)->items = malloc(64 * sizeof(Value32));
-            assert(((Array *)vars[vars_count-1].as.pointer)->items != NULL);
-
-            printf("\n");
-
-            char buf[64];
-            fgets(buf, sizeof(buf), stdin);
-
-            int i = 0;
-            while (buf[i] != '\n' && buf[i] != '\0') {
-                ((Array *)vars[vars_count-1].as.pointer)->items[i].integer = (int)buf[i];
-                i++;
+        case OP_CALL:
+        case OP_TAILCALL:
+            if (find_function(code, name) == -1 && (op == OP_TAILCALL || strcmp(name, "print") != 0)) {
+                result = verify_fail(pos, "unresolved call");
+                goto done;
             }
-            ((Array *)vars[vars_count-1].as.pointer)->len = i;
-
-            push(&stack_ptr, vars[vars_count-1], vars[vars_count-1].type);
-            consume_byte(code, &cur_byte);
             break;
-        }
         case OP_JMP:
-            cur_byte = code->line_positions->positions[pop(&stack_ptr).as.integer];
-            break;
-        case OP_JMPB:
-            cur_byte = pop(&stack_ptr).as.integer;
-            break;
-        case OP_WHEN:
-            when_queue_add(&when_queue, 1, pop(&stack_ptr).as.integer, pop(&stack_ptr).as.integer, cur_byte+1, pop(&stack_ptr).as.integer, 0);
-            consume_byte(code, &cur_byte);
-            skip_instruction(code, &cur_byte);
-            break;
-        case OP_WHEN_NOT:
-            when_queue_add(&when_queue, 0, pop(&stack_ptr).as.integer, pop(&stack_ptr).as.integer, cur_byte+1, pop(&stack_ptr).as.integer, 0);
-            consume_byte(code, &cur_byte);
-            skip_instruction(code, &cur_byte);
-            break;
-        case OP_PROMISE:
-            when_queue_add(&when_queue, 1, pop(&stack_ptr).as.integer, pop(&stack_ptr).as.integer, cur_byte+1, pop(&stack_ptr).as.integer, 1);
-            consume_byte(code, &cur_byte);
-            skip_instruction(code, &cur_byte);
-            break;
-        case OP_PROMISE_NOT:
-            when_queue_add(&when_queue, 0, pop(&stack_ptr).as.integer, pop(&stack_ptr).as.integer, cur_byte+1, pop(&stack_ptr).as.integer, 1);
-            consume_byte(code, &cur_byte);
-            skip_instruction(code, &cur_byte);
-            break;
-        case OP_POPR:
-            pop(&return_stack_ptr);
-            consume_byte(code, &cur_byte);
-            break;
         case OP_JMPS:
-            push_i(&return_stack_ptr, cur_byte+1);
-            cur_byte = code->line_positions->positions[pop(&stack_ptr).as.integer];
+            if (!has_known || known < 0 || (size_t)known >= lines->count ||
+                lines->positions[known] >= count || !starts[lines->positions[known]]) {
+                result = verify_fail(pos, "jump to an unknown line");
+                goto done;
+            }
             break;
+        case OP_JMPB:
         case OP_JMPBS:
-            push_i(&return_stack_ptr, cur_byte+1);
-            cur_byte = pop(&stack_ptr).as.integer;
+            if (!has_known || known < 0 || known >= count || !starts[known]) {
+                result = verify_fail(pos, "jump to an unknown byte");
+                goto done;
+            }
             break;
         case OP_JMPBSI:
-            push_i(&return_stack_ptr, cur_byte+2);
-            cur_byte = consume_byte(code, &cur_byte);
-            break;
-        case OP_JMPBSC:
-            push_i(&return_stack_ptr, cur_byte+2);
-            cur_byte = code->constant_list->constants[consume_byte(code, &cur_byte)].as.integer;
-            break;
-        case OP_ADD:
-            push_i(&stack_ptr, pop(&stack_ptr).as.integer+pop(&stack_ptr).as.integer);
-            consume_byte(code, &cur_byte);
-            break;
-        case OP_SUB: {
-            int num1 = pop(&stack_ptr).as.integer;
-            int num2 = pop(&stack_ptr).as.integer;
-            push_i(&stack_ptr, num2 - num1);
-            consume_byte(code, &cur_byte);
-            break;
-        }
-        case OP_SET_ARRAY: {
-            int index = consume_byte(code, &cur_byte) + scope*256;
-            vars[index].type = 2;
-            vars[index].as.pointer = (uintptr_t)malloc(sizeof(Array));
-            ((Array *)vars[index].as.pointer)->len = 16;
-            ((Array *)vars[index].as.pointer)->items = malloc(16 * sizeof(Value32));
-            assert(((Array *)vars[index].as.pointer)->items != NULL);
-            consume_byte(code, &cur_byte);
+        case OP_JMPBSC: {
+            int target = operand;
+            if (op == OP_JMPBSC) {
+                if (operand >= code->constant_list->count) {
+                    result = verify_fail(pos, "constant out of range");
+                    goto done;
+                }
+                target = value_as_int(code->constant_list->constants[operand]);
+            }
+            if (target < 0 || target >= count || !starts[target]) {
+                result = verify_fail(pos, "when body outside the code");
+                goto done;
+            }
             break;
         }
-        case OP_SET_INDEX: {
-            int val = pop(&stack_ptr).as.integer;
-            int index = pop(&stack_ptr).as.integer;
-            ((Array *)vars[pop(&stack_ptr).as.integer + scope*256].as.pointer)->items[index].integer = val;
-            consume_byte(code, &cur_byte);
+        case OP_BULK: {
+            int descs = code->bytes[pos+3];
+            for (int d = 0; d < descs; d++) {
+                uint8_t *desc = &code->bytes[pos+4+d*3];
+                if (desc[0] > BULK_UNTIL_NE || (desc[0] == BULK_FILL_CONST && desc[2] >= code->constant_list->count)) {
+                    result = verify_fail(pos, "bad bulk descriptor");
+                    goto done;
+                }
+            }
+            if (descs == 0 || (code->bytes[pos+4+(descs-1)*3] == BULK_UNTIL_NE && descs < 2)) {
+                result = verify_fail(pos, "bad bulk descriptor");
+                goto done;
+            }
             break;
         }
-        case OP_SET_LEN: {
-            int array = pop(&stack_ptr).as.integer + scope*256;
-            int len = pop(&stack_ptr).as.integer;
-            ((Array *)vars[array].as.pointer)->len = len;
-            ((Array *)vars[array].as.pointer)->items = realloc(((Array *)vars[array].as.pointer)->items, len * sizeof(Value32));
-            assert(((Array *)vars[array].as.pointer)->items != NULL);
-            consume_byte(code, &cur_byte);
-            break;
+        default: break;
         }
-        case OP_SETP_INDEX: {
-            int val = pop(&stack_ptr).as.integer;
-            int index = pop(&stack_ptr).as.integer;
-            int array = pop(&stack_ptr).as.integer + scope*256;
-            ((Array *)vars[array].as.pointer)->items[index].integer = val;
-            push_i(&stack_ptr, ((Array *)vars[array].as.pointer)->items[index].integer);
-            consume_byte(code, &cur_byte);
-            break;
+
+        int pops, pushes;
+        stack_effect(code, pos, &pops, &pushes);
+        if (growth < 0) growth = 0;
+        growth += pushes - pops;
+        if (growth > peak) peak = growth;
+        if (is_transfer(code, pos)) growth = 0;
+
+        known = next_known;
+        has_known = next_has_known;
+    }
+    if (function != -1) functions->functions[function].max_depth = peak;
+    if (peak > headroom) headroom = peak;
+
+    if (last != OP_HLT && last != OP_RET && last != OP_RETS && last != OP_JMP && last != OP_JMPB && last != OP_TAILCALL) {
+        result = verify_fail(count, "code falls off the end");
+    }
+    else if (headroom >= STACK_SIZE) {
+        result = verify_fail(count, "headroom larger than the stack");
+    }
+    else {
+        result = headroom;
+    }
+
+done:
+    plea_free(starts);
+    return result;
+}
+
+void bad_bytecode(int pos, const char *what) {
+    fprintf(stderr, "Bad bytecode at %d: %s\n", pos, what);
+    exit(1);
+}
+
+/* Run before every dispatch of code the verifier did not accept */
+void check_step(Code *code, int cur_byte, Value *stack, Value *stack_ptr, Value *return_stack, Value *return_stack_ptr) {
+    uint8_t op = code->bytes[cur_byte];
+    if (instruction_length(code, cur_byte) == 0 || op_name(op) == NULL) {
+        fprintf(stderr, "Unknown instruction: %d\n", op);
+        exit(1);
+    }
+
+    int pops, pushes;
+    stack_effect(code, cur_byte, &pops, &pushes);
+    if (stack_ptr - stack < pops) bad_bytecode(cur_byte, "stack underflow");
+    if (stack_ptr - stack - pops + pushes > STACK_SIZE || return_stack_ptr - return_stack >= RETURN_STACK_SIZE) {
+        fprintf(stderr, "%d: The stack is too deep\n", source_line(code, cur_byte));
+        exit(1);
+    }
+
+    switch (op) {
+    case OP_RET:
+    case OP_RETS:
+    case OP_POPR:
+        if (return_stack_ptr == return_stack) bad_bytecode(cur_byte, "return stack underflow");
+        break;
+    case OP_CONST:
+    case OP_JMPBSC:
+        if (code->bytes[cur_byte+1] >= code->constant_list->count) bad_bytecode(cur_byte, "constant out of range");
+        if (op == OP_JMPBSC && (size_t)value_as_int(code->constant_list->constants[code->bytes[cur_byte+1]]) >= code->count) {
+            bad_bytecode(cur_byte, "when body outside the code");
         }
-        case OP_SETP_LEN: {
-            int array = pop(&stack_ptr).as.integer + scope*256;
-            int len = pop(&stack_ptr).as.integer;
-            ((Array *)vars[array].as.pointer)->len = len;
-            ((Array *)vars[array].as.pointer)->items = realloc(((Array *)vars[array].as.pointer)->items, len * sizeof(Value32));
-            assert(((Array *)vars[array].as.pointer)->items != NULL);
-            push_i(&stack_ptr, len);
-            consume_byte(code, &cur_byte);
-            break;
+        break;
+    case OP_JMP:
+    case OP_JMPS: {
+        int line = value_as_int(stack_ptr[-1]);
+        if (line < 0 || (size_t)line >= code->line_positions->count || (size_t)code->line_positions->positions[line] >= code->count) {
+            fprintf(stderr, "%d: There is no line %d to jump to\n", source_line(code, cur_byte), line);
+            exit(1);
         }
-        case OP_PUSH_INDEX: {
-            int index = pop(&stack_ptr).as.integer;
-            push_i(&stack_ptr, ((Array *)vars[pop(&stack_ptr).as.integer + scope*256].as.pointer)->items[index].integer);
-            consume_byte(code, &cur_byte);
-            break;
+        break;
+    }
+    case OP_JMPB:
+    case OP_JMPBS:
+        if (value_as_int(stack_ptr[-1]) < 0 || (size_t)value_as_int(stack_ptr[-1]) >= code->count) {
+            bad_bytecode(cur_byte, "jump outside the code");
         }
-        default: break;
+        break;
+    case OP_CALL:
+    case OP_TAILCALL: {
+        char *name = (char *)&code->bytes[cur_byte+1];
+        if (find_function(code, name) == -1 && (op == OP_TAILCALL || strcmp(name, "print") != 0)) {
+            fprintf(stderr, "%d: Unknown function: %s\n", source_line(code, cur_byte), name);
+            exit(1);
         }
+        break;
+    }
+    default: break;
+    }
+}
 
-        for (unsigned i = 0; i < when_queue.count; i++) {
-            if (when_queue.whens[i].cond == -1) continue;
-            if (when_queue.whens[i].loc < code->function_list->functions[cur_function].location ||
-                (code->function_list->count-cur_function <= 0 && when_queue.whens[i].loc >= code->function_list->functions[cur_function+1].location))
-                continue;
-
-            int val1 = (when_queue.whens[i].mode & 1) ? vars[when_queue.whens[i].val1].as.integer : when_queue.whens[i].val1;
-            int val2 = (when_queue.whens[i].mode & 2) ? vars[when_queue.whens[i].val2].as.integer : when_queue.whens[i].val2;
-            if ((val1 == val2) == when_queue.whens[i].cond) {
-                cur_byte = when_queue.whens[i].loc;
-                if (i == when_queue.count-1) {
-                    when_queue.count--;
-                }
-                else {
-                    when_queue.whens[i].cond = -1;
-                }
-                break;
-            }
-            if (when_queue.whens[i].loc > cur_byte) when_queue.whens[i].cond = -1;
-        }
+int check_headroom(Code *code, int cur_byte, Value *stack_ptr, Value *stack_limit, Value *return_stack_ptr, Value *return_limit) {
+    if (stack_ptr > stack_limit || return_stack_ptr >= return_limit) {
+        fprintf(stderr, "%d: The stack is too deep\n", source_line(code, cur_byte));
+        return 0;
+    }
+    return 1;
+}
 
-#ifdef PLEA_DEBUG
-        disassemble_byte(code->bytes[cur_byte], cur_byte);
-#endif
+/* How many instructions to run before the next checkpoint */
+long long checkpoint_interval(Vm *vm) {
+    long long interval = CHECK_INTERVAL;
+    if (vm->options->snapshot_every > 0 && vm->next_snapshot - vm->executed < interval) {
+        interval = vm->next_snapshot - vm->executed;
     }
+    if (vm->fuel_end - vm->executed < interval) interval = vm->fuel_end - vm->executed;
+    vm->interval = interval;
+    return interval;
+}
 
-    uintptr_t *freed = malloc(vars_count * sizeof(uintptr_t));
-    int freed_count = 0;
-    for (int i = 0; i < vars_count; i++) {
-        if (vars[i].type == 2) {
-            int already_freed = 0;
-            for (int j = 0; j < freed_count; j++) {
-                if (freed[j] == vars[i].as.pointer) {
-                    already_freed = 1;
-                    break;
-                }
-            }
+/* Instructions run so far, exact whenever the VM is stopped */
+long long vm_executed(Vm *vm) {
+    return vm->executed + vm->interval - vm->countdown;
+}
 
-            if (!already_freed) {
-                free(((Array *)vars[i].as.pointer)->items);
-                free((Array *)vars[i].as.pointer);
-                freed[freed_count++] = vars[i].as.pointer;
-            }
+/* Brings executed up to date and plans the next checkpoint, for when the
+ * fuel changes between runs */
+void plan_checkpoint(Vm *vm) {
+    vm->executed = vm_executed(vm);
+    vm->countdown = checkpoint_interval(vm);
+}
+
+/* Runs between two instructions once per interval, to count what has run
+ * and write the snapshot when one is due or was asked for */
+long long checkpoint(Vm *vm) {
+    Run_Options *options = vm->options;
+    vm->executed += vm->interval;
+    int due = options->snapshot_every > 0 && vm->executed >= vm->next_snapshot;
+    if (due) vm->next_snapshot = vm->executed + options->snapshot_every;
+    if ((snapshot_requested() || due) && options->snapshot_path) {
+        snapshot_write(options->snapshot_path, vm);
+    }
+    return checkpoint_interval(vm);
+}
+
+/* Verified code only has its headroom tested where control transfers,
+ * reported at the transferring instruction; anything else runs checked,
+ * with every dispatch validated first */
+#define CHECK_STEP() if (CHECKED) check_step(code, cur_byte, stack, stack_ptr, return_stack, return_stack_ptr)
+#define CHECK_TRANSFER() if (!CHECKED && !check_headroom(code, op_byte, stack_ptr, stack_limit, return_stack_ptr, return_limit)) goto fail
+
+/* Stores the loop's locals back into the VM */
+#define SAVE_STATE() do { \
+        vm->stack_ptr = stack_ptr; \
+        vm->return_stack_ptr = return_stack_ptr; \
+        vm->vars = vars; \
+        vm->vars_count = vars_count; \
+        vm->scope = scope; \
+        vm->cur_byte = cur_byte; \
+        vm->cur_function = cur_function; \
+        vm->when_queue = when_queue; \
+        vm->countdown = countdown; \
+    } while (0)
+
+#define RUN_LOOP run_loop
+#define CHECKED 0
+#define TRACE_STEP()
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef CHECKED
+#undef TRACE_STEP
+
+#define RUN_LOOP run_loop_checked
+#define CHECKED 1
+#define TRACE_STEP()
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef CHECKED
+#undef TRACE_STEP
+
+#define RUN_LOOP run_loop_traced
+#define CHECKED 1
+#define TRACE_STEP() trace_record(cur_byte, code->bytes[cur_byte], stack_ptr > stack ? value_as_int(stack_ptr[-1]) : 0, scope, (int)(stack_ptr - stack))
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef CHECKED
+#undef TRACE_STEP
+
+/* Unchecked like run_loop, so what is counted is the dispatch that
+ * verified code really gets */
+#define RUN_LOOP run_loop_counted
+#define CHECKED 0
+#define TRACE_STEP() hwcounters_step(code->bytes[cur_byte])
+#include "vm_loop.h"
+#undef RUN_LOOP
+#undef CHECKED
+#undef TRACE_STEP
+
+/* A new VM stopped before the program's first instruction, or where the
+ * snapshot to restore left off */
+Vm *vm_new(Code *code, int headroom, Run_Options *options) {
+    Vm *vm = plea_calloc(SITE_VMS, 1, sizeof(Vm));
+    vm->code = code;
+    vm->options = options;
+    vm->headroom = headroom;
+    vm->stack_ptr = vm->stack;
+    vm->return_stack_ptr = vm->return_stack;
+    vm->vars_count = 256;
+    vm->scope = -1;
+    when_queue_init(&vm->when_queue);
+
+    if (options->restore_path) {
+        /* A snapshot is taken past the beg check, which is not run again */
+        snapshot_read(options->restore_path, vm);
+    }
+    else {
+        vm->vars = plea_calloc(SITE_SCOPES, 256, sizeof(Value));
+        if (code->bytes[0] != OP_BEG) {
+            fprintf(stderr, "Programmer has insufficiently begged\n");
+            vm->status = VM_FAILED;
         }
     }
-    free(freed);
-    free(when_queue.whens);
-    free(vars);
-}
-
-void disassemble_byte(uint8_t byte, int cur_byte) {
-    switch (byte) {
-    case OP_CONST: printf("\tCONST");             break;
-    case OP_INC: printf("\tINC");                 break;
-    case OP_DEC: printf("\tDEC");                 break;
-    case OP_SET_VAR: printf("\tSET_VAR");         break;
-    case OP_SET_ARRAY: printf("\tSET_ARRAY");     break;
-    case OP_SET_INDEX: printf("\tSET_INDEX");     break;
-    case OP_SET_LEN: printf("\tSET_LEN");         break;
-    case OP_SETP_INDEX: printf("\tSETP_INDEX");   break;
-    case OP_SETP_LEN: printf("\tSETP_LEN");       break;
-    case OP_PUSH: printf("\tPUSH");               break;
-    case OP_PUSH_INDEX: printf("\tPUSH_INDEX");   break;
-    case OP_PUSHI: printf("\tPUSHI");             break;
-    case OP_POP: printf("\tPOP");                 break;
-    case OP_CALL: printf("\tCALL");               break;
-    case OP_RET: printf("\tRET");                 break;
-    case OP_BEG: printf("\tBEG");                 break;
-    case OP_FNCTN: printf("\tFNCTN");             break;
-    case OP_HLT: printf("\tHLT");                 break;
-    case OP_INPUT: printf("\tINPUT");             break;
-    case OP_JMP: printf("\tJMP");                 break;
-    case OP_JMPB: printf("\tJMPB");               break;
-    case OP_WHEN: printf("\tWHEN");               break;
-    case OP_WHEN_NOT: printf("\tWHEN_NOT");       break;
-    case OP_PROMISE: printf("\tPROMISE");         break;
-    case OP_PROMISE_NOT: printf("\tPROMISE_NOT"); break;
-    case OP_POPR: printf("\tPOPR");               break;
-    case OP_JMPS: printf("\tJMPS");               break;
-    case OP_JMPBS: printf("\tJMPBS");             break;
-    case OP_ADD: printf("\tADD");                 break;
-    case OP_SUB: printf("\tSUB");                 break;
-    case OP_RETS: printf("\tRETS");               break;
-    case OP_JMPBSI: printf("\tJMPBSI");           break;
-    case OP_JMPBSC: printf("\tJMPBSC");           break;
-    default: fprintf(stderr, "Unknown instruction: %d\n", byte); exit(1);
-    }
-    printf(" (%d)\n", cur_byte);
-}
-
-char *disassemble(Code *code) {
-    String_Builder disasm = (String_Builder){
-        .count = 0,
-        .capacity = 4,
-        .string = malloc(4 * sizeof(char))
-    };
+
+    vm->next_snapshot = vm->executed + options->snapshot_every;
+    return vm;
+}
+
+/* Runs until the program ends, fails or, if hosted, waits for input, or
+ * until fuel instructions have run, when it yields. A VM that ended stays
+ * that way. */
+Vm_Status vm_run_for(Vm *vm, long long fuel) {
+    if (vm->status == VM_HALTED || vm->status == VM_FAILED) return vm->status;
+    vm->fuel_end = fuel < LLONG_MAX - vm_executed(vm) ? vm_executed(vm) + fuel : LLONG_MAX;
+    plan_checkpoint(vm);
+
+    if (vm->options->trace_path) return run_loop_traced(vm);
+    if (vm->headroom == -1) return run_loop_checked(vm);
+    if (vm->options->hwcounters) return run_loop_counted(vm);
+    return run_loop(vm);
+}
+
+Vm_Status vm_run(Vm *vm) {
+    return vm_run_for(vm, LLONG_MAX);
+}
+
+void vm_free(Vm *vm) {
+    release_values(vm->stack, vm->stack_ptr);
+    release_values(vm->vars, vm->vars + vm->vars_count);
+    when_queue_free(&vm->when_queue);
+    plea_free(vm->vars);
+    plea_free(vm);
+}
+
+FILE *open_run_file(const char *path, const char *mode) {
+    FILE *file = fopen(path, mode);
+    if (file == NULL) {
+        fprintf(stderr, "Could not open the file \"%s\"\n", path);
+        exit(1);
+    }
+    return file;
+}
+
+void run_bytecode(Code *code, Run_Options *options) {
+    int headroom = verify(code);
+
+    options->input = options->replay_path ? open_run_file(options->replay_path, "r")
+        : options->deterministic ? NULL
+        : stdin;
+    options->record = options->record_path ? open_run_file(options->record_path, "w") : NULL;
+    options->output = stdout;
+    if (options->snapshot_path) snapshot_on_signal();
+    if (options->trace_path) trace_open(options->trace_path);
+    if (options->hwcounters && (options->trace_path || headroom == -1)) {
+        fprintf(stderr, "Hardware counters are only read for verified code run without a trace\n");
+        options->hwcounters = 0;
+    }
+    if (options->hwcounters) options->hwcounters = hwcounters_start(stderr);
+
+    Vm *vm = vm_new(code, headroom, options);
+    Vm_Status status = options->max_instructions > 0 ? vm_run_for(vm, options->max_instructions) : vm_run(vm);
+
+    /* Out of fuel, the run can still be picked up from a snapshot */
+    if (status == VM_YIELDED) {
+        fflush(stdout);
+        fprintf(stderr, "Stopped after %lld instructions\n", vm_executed(vm));
+        if (options->snapshot_path) snapshot_write(options->snapshot_path, vm);
+    }
+    vm_free(vm);
+
+    if (options->replay_path) fclose(options->input);
+    if (options->record) fclose(options->record);
+    if (status != VM_HALTED) exit(1);
+}
+
+char *op_name(uint8_t op) {
+    switch (op) {
+    case OP_CONST:        return "CONST";
+    case OP_INC:          return "INC";
+    case OP_DEC:          return "DEC";
+    case OP_SET_VAR:      return "SET_VAR";
+    case OP_SET_ARRAY:    return "SET_ARRAY";
+    case OP_SET_INDEX:    return "SET_INDEX";
+    case OP_SET_LEN:      return "SET_LEN";
+    case OP_SETP_INDEX:   return "SETP_INDEX";
+    case OP_SETP_LEN:     return "SETP_LEN";
+    case OP_SET_INDEX_I:  return "SET_INDEX_I";
+    case OP_SET_INDEX_C:  return "SET_INDEX_C";
+    case OP_SETP_INDEX_I: return "SETP_INDEX_I";
+    case OP_SETP_INDEX_C: return "SETP_INDEX_C";
+    case OP_PUSH:         return "PUSH";
+    case OP_PUSH_INDEX:   return "PUSH_INDEX";
+    case OP_PUSH_INDEX_I: return "PUSH_INDEX_I";
+    case OP_PUSH_INDEX_C: return "PUSH_INDEX_C";
+    case OP_PUSHI:        return "PUSHI";
+    case OP_POP:          return "POP";
+    case OP_CALL:         return "CALL";
+    case OP_RET:          return "RET";
+    case OP_BEG:          return "BEG";
+    case OP_FNCTN:        return "FNCTN";
+    case OP_HLT:          return "HLT";
+    case OP_INPUT:        return "INPUT";
+    case OP_JMP:          return "JMP";
+    case OP_JMPB:         return "JMPB";
+    case OP_WHEN:         return "WHEN";
+    case OP_WHEN_NOT:     return "WHEN_NOT";
+    case OP_PROMISE:      return "PROMISE";
+    case OP_PROMISE_NOT:  return "PROMISE_NOT";
+    case OP_POPR:         return "POPR";
+    case OP_JMPS:         return "JMPS";
+    case OP_JMPBS:        return "JMPBS";
+    case OP_ADD:          return "ADD";
+    case OP_SUB:          return "SUB";
+    case OP_RETS:         return "RETS";
+    case OP_JMPBSI:       return "JMPBSI";
+    case OP_JMPBSC:       return "JMPBSC";
+    case OP_BULK:         return "BULK";
+    case OP_TAILCALL:     return "TAILCALL";
+    case OP_DROP:         return "DROP";
+    case OP_TEST:         return "TEST";
+    case OP_TEST_NOT:     return "TEST_NOT";
+    case OP_INC_F:        return "INC_F";
+    case OP_DEC_F:        return "DEC_F";
+    case OP_ADD_F:        return "ADD_F";
+    case OP_SUB_F:        return "SUB_F";
+    case OP_TEST_F:       return "TEST_F";
+    case OP_TEST_NOT_F:   return "TEST_NOT_F";
+    default: return NULL;
+    }
+}
+
+char *bulk_op_name(uint8_t op) {
+    switch (op) {
+    case BULK_FILL_IMM:   return "fill_imm";
+    case BULK_FILL_CONST: return "fill_const";
+    case BULK_FILL_VAR:   return "fill_var";
+    case BULK_COPY:       return "copy";
+    case BULK_LOAD:       return "load";
+    case BULK_UNTIL_NE:   return "until_ne";
+    default:              return "?";
+    }
+}
+
+void disassemble_target(Code *code, FILE *out, int line) {
+    if (line >= 0 && (unsigned)line < code->line_positions->count) {
+        fprintf(out, "\t; -> L%d @%d", line, code->line_positions->positions[line]);
+    }
+    else {
+        fprintf(out, "\t; -> L%d (out of range)", line);
+    }
+}
+
+/* Writes one instruction per line with its byte offset. Line labels mark
+ * the targets of line-relative jumps and note the source line where it
+ * changes; jumps whose line is pushed just before them are resolved, as
+ * are call targets and constants. */
+void disassemble(Code *code, FILE *out) {
+    unsigned line = 0;
+    int known = 0;
+    int has_known = 0;
+    Line_Cursor cursor = { .at = 0, .byte = 0, .line = 1 };
+    int shown = 0;
 
     int i = 0;
     while ((unsigned)i < code->count) {
-        switch (code->bytes[i]) {
-        case OP_CONST:
-            sb_appendf(&disasm, "\tCONST %d (%d)\n", consume_byte(code, &i), code->constant_list->constants[code->bytes[i]].as.integer);
-            consume_byte(code, &i);
-            break;
-        case OP_INC:
-            sb_append(&disasm, "\tINC\n");
-            consume_byte(code, &i);
-            break;
-        case OP_DEC:
-            sb_append(&disasm, "\tDEC\n");
-            consume_byte(code, &i);
-            break;
-        case OP_SET_VAR: {
-            int index = consume_byte(code, &i);
-            int val = consume_byte(code, &i);
-            sb_appendf(&disasm, "\tSET_VAR %d %d\n", index, val);
-            consume_byte(code, &i);
-            break;
+        for (; line < code->line_positions->count && code->line_positions->positions[line] <= i; line++) {
+            int source = advance_line_cursor(code, &cursor, code->line_positions->positions[line]);
+            if (source != shown) {
+                fprintf(out, "L%u:\t; line %d\n", line, source);
+                shown = source;
+            }
+            else {
+                fprintf(out, "L%u:\n", line);
+            }
         }
-        case OP_SET_ARRAY: {
-            int index = consume_byte(code, &i);
-            sb_appendf(&disasm, "\tSET_ARRAY %d\n", index);
-            consume_byte(code, &i);
-            break;
+
+        uint8_t op = code->bytes[i];
+        char *name = op_name(op);
+        if (!name) {
+            fprintf(stderr, "Unknown instruction: %d\n", op);
+            exit(1);
+        }
+
+        if (op == OP_FNCTN) {
+            char *func_name = (char *)&code->bytes[i+1];
+            int function = find_function(code, func_name);
+            fprintf(out, "\n%6d FNCTN %s", i, func_name);
+            if (function != -1) {
+                Function *f = &code->function_list->functions[function];
+                fprintf(out, "\t; %d args, body @%d", f->arity, f->location);
+                if (f->max_depth >= 0) fprintf(out, ", depth %d", f->max_depth);
+            }
+            fprintf(out, "\n");
+            i += (int)strlen(func_name) + 2;
+            has_known = 0;
+            continue;
         }
-        case OP_SET_INDEX:
-            sb_appendf(&disasm, "\tSET_INDEX\n");
-            consume_byte(code, &i);
+
+        fprintf(out, "%6d\t%s", i, name);
+
+        int next_known = 0;
+        int next_has_known = 0;
+        switch (op) {
+        case OP_CONST: {
+            Value constant = code->constant_list->constants[code->bytes[i+1]];
+            int val = value_as_int(constant);
+            if (value_is_real(constant)) {
+                fprintf(out, " %d\t; = %g", code->bytes[i+1], value_as_real(constant));
+            }
+            else {
+                fprintf(out, " %d\t; = %d", code->bytes[i+1], val);
+            }
+            next_known = val;
+            next_has_known = 1;
+            i += 2;
             break;
-        case OP_SET_LEN:
-            sb_appendf(&disasm, "\tSET_LEN\n");
-            consume_byte(code, &i);
+        }
+        case OP_PUSHI:
+            fprintf(out, " %d", code->bytes[i+1]);
+            next_known = code->bytes[i+1];
+            next_has_known = 1;
+            i += 2;
             break;
-        case OP_SETP_INDEX:
-            sb_appendf(&disasm, "\tSETP_INDEX\n");
-            consume_byte(code, &i);
+        case OP_INC:
+        case OP_DEC:
+            next_known = known + (op == OP_INC ? 1 : -1);
+            next_has_known = has_known;
+            i++;
             break;
-        case OP_SETP_LEN:
-            sb_appendf(&disasm, "\tSETP_LEN\n");
-            consume_byte(code, &i);
+        case OP_POPR:
+            next_known = known;
+            next_has_known = has_known;
+            i++;
             break;
         case OP_PUSH:
-            sb_appendf(&disasm, "\tPUSH %d\n", consume_byte(code, &i));
-            consume_byte(code, &i);
+        case OP_POP:
+            fprintf(out, " %d", code->bytes[i+1]);
+            i += 2;
             break;
-        case OP_PUSH_INDEX:
-            sb_appendf(&disasm, "\tPUSH_INDEX\n");
-            consume_byte(code, &i);
-            break;
-        case OP_PUSHI:
-            sb_appendf(&disasm, "\tPUSHI %d\n", consume_byte(code, &i));
-            consume_byte(code, &i);
+        case OP_SET_VAR:
+        case OP_SET_ARRAY:
+            fprintf(out, " %d %d", code->bytes[i+1], code->bytes[i+2]);
+            i += 3;
             break;
         case OP_JMPBSI:
-            sb_appendf(&disasm, "\tJMPBSI %d\n", consume_byte(code, &i));
-            consume_byte(code, &i);
+            fprintf(out, " %d\t; -> @%d", code->bytes[i+1], code->bytes[i+1]);
+            i += 2;
             break;
         case OP_JMPBSC:
-            sb_appendf(&disasm, "\tJMPBSC %d\n", consume_byte(code, &i));
-            consume_byte(code, &i);
-            break;
-        case OP_POP:
-            sb_appendf(&disasm, "\tPOP %d\n", consume_byte(code, &i));
-            consume_byte(code, &i);
-            break;
-        case OP_CALL:
-            consume_byte(code, &i);
-            sb_appendf(&disasm, "\tCALL %s\n", (char *)&code->bytes[i]);
-            while (code->bytes[i] != 0) {
-                consume_byte(code, &i);
-            }
-            consume_byte(code, &i);
-            break;
-        case OP_RET:
-            sb_append(&disasm, "\tRET\n");
-            consume_byte(code, &i);
-            break;
-        case OP_BEG:
-            consume_byte(code, &i);
-            sb_appendf(&disasm, "\tBEG \"%s\"\n", (char *)&code->bytes[i]);
-            while (code->bytes[i] != 0) {
-                consume_byte(code, &i);
-            }
-            consume_byte(code, &i);
-            break;
-        case OP_FNCTN:
-            consume_byte(code, &i);
-            sb_appendf(&disasm, "\nFNCTN %s\n", (char *)&code->bytes[i]);
-            while (code->bytes[i] != 0) {
-                consume_byte(code, &i);
-            }
-            consume_byte(code, &i);
-            break;
-        case OP_HLT:
-            sb_append(&disasm, "\tHLT\n");
-            consume_byte(code, &i);
-            break;
-        case OP_INPUT:
-            sb_append(&disasm, "\tINPUT\n");
-            consume_byte(code, &i);
+            fprintf(out, " %d\t; -> @%d", code->bytes[i+1], value_as_int(code->constant_list->constants[code->bytes[i+1]]));
+            i += 2;
             break;
         case OP_JMP:
-            sb_appendf(&disasm, "\tJMP\n");
-            consume_byte(code, &i);
+        case OP_JMPS:
+            if (has_known) disassemble_target(code, out, known);
+            i++;
             break;
         case OP_JMPB:
-            sb_appendf(&disasm, "\tJMPB\n");
-            consume_byte(code, &i);
+        case OP_JMPBS:
+            if (has_known) fprintf(out, "\t; -> @%d", known);
+            i++;
             break;
         case OP_WHEN:
-            sb_appendf(&disasm, "\tWHEN\n");
-            consume_byte(code, &i);
-            break;
         case OP_WHEN_NOT:
-            sb_appendf(&disasm, "\tWHEN_NOT\n");
-            consume_byte(code, &i);
-            break;
         case OP_PROMISE:
-            sb_appendf(&disasm, "\tPROMISE\n");
-            consume_byte(code, &i);
-            break;
         case OP_PROMISE_NOT:
-            sb_appendf(&disasm, "\tPROMISE_NOT\n");
-            consume_byte(code, &i);
+            fprintf(out, "\t; watch fires @%d", i+1);
+            i++;
             break;
-        case OP_POPR:
-            sb_appendf(&disasm, "\tPOPR\n");
-            consume_byte(code, &i);
-            break;
-        case OP_JMPS:
-            sb_appendf(&disasm, "\tJMPS\n");
-            consume_byte(code, &i);
+        case OP_TEST:
+        case OP_TEST_NOT:
+        case OP_TEST_F:
+        case OP_TEST_NOT_F:
+            fprintf(out, "\t; else skip @%d", i+1);
+            i++;
             break;
-        case OP_JMPBS:
-            sb_appendf(&disasm, "\tJMPBS\n");
-            consume_byte(code, &i);
-            break;
-        case OP_ADD:
-            sb_appendf(&disasm, "\tADD\n");
-            consume_byte(code, &i);
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_BEG: {
+            char *str = (char *)&code->bytes[i+1];
+            if (op == OP_BEG) {
+                fprintf(out, " \"%s\"", str);
+            }
+            else {
+                int function = find_function(code, str);
+                fprintf(out, " %s", str);
+                if (function != -1) {
+                    fprintf(out, "\t; -> @%d", code->function_list->functions[function].location);
+                }
+                else if (strcmp(str, "print") == 0) {
+                    fprintf(out, "\t; builtin");
+                }
+                else {
+                    fprintf(out, "\t; unresolved");
+                }
+            }
+            i += (int)strlen(str) + 2;
             break;
-        case OP_SUB:
-            sb_appendf(&disasm, "\tSUB\n");
-            consume_byte(code, &i);
+        }
+        case OP_BULK: {
+            int count = code->bytes[i+3];
+            fprintf(out, " %d %s %d", code->bytes[i+1], code->bytes[i+2] ? "-" : "+", count);
+            for (int d = 0; d < count; d++) {
+                uint8_t *desc = &code->bytes[i+4+d*3];
+                fprintf(out, "\n\t\t%s %d %d", bulk_op_name(desc[0]), desc[1], desc[2]);
+            }
+            i += 4 + count*3;
             break;
-        case OP_RETS:
-            sb_appendf(&disasm, "\tRETS\n");
-            consume_byte(code, &i);
+        }
+        default:
+            i++;
             break;
-        default: fprintf(stderr, "Unknown instruction: %d\n", code->bytes[i]); exit(1);
         }
+        fprintf(out, "\n");
+
+        known = next_known;
+        has_known = next_has_known;
     }
-    return disasm.string;
 }
 
-void check_beg_text(char *beg_text) {
-    srand(time(NULL));
+/* Works on a copy and its own random state, since the code may be shared
+ * by VMs on other threads */
+int check_beg_text(const char *beg, Run_Options *options) {
+    unsigned random_state = options->deterministic ? options->seed : (unsigned)time(NULL);
     int probability = 0;
 
-    int num_chars = (int)strlen(beg_text);
+    char beg_text[256];
+    int num_chars = (int)strlen(beg);
+    if (num_chars > 255) num_chars = 255;
+    memcpy(beg_text, beg, num_chars);
+    beg_text[num_chars] = '\0';
     int num_spaces = 0;
     int num_excl = 0;
     for (int i = 0; i < num_chars; i++) {
@@ -688,11 +1078,11 @@ void check_beg_text(char *beg_text) {
     }
     if (num_spaces == 0) {
         fprintf(stderr, "Programmer has insufficiently begged\n");
-        exit(1);
+        return 0;
     }
     if (num_chars/num_spaces > 10) {
         fprintf(stderr, "Programmer has insufficiently begged\n");
-        exit(1);
+        return 0;
     }
 
     for (int i = 0; i < num_chars; i++) {
@@ -713,14 +1103,17 @@ void check_beg_text(char *beg_text) {
     }
     probability += num_excl*2;
 
-    time_t t = time(NULL);
-    struct tm *local_time = localtime(&t);
-    if (local_time->tm_hour < 9) {
+    time_t t = options->deterministic ? (time_t)options->clock : time(NULL);
+    struct tm local_time;
+    if (options->deterministic) gmtime_r(&t, &local_time);
+    else localtime_r(&t, &local_time);
+    if (local_time.tm_hour < 9) {
         probability -= 20;
     }
 
-    if (rand()%100 >= probability) {
+    if (rand_r(&random_state)%100 >= probability) {
         fprintf(stderr, "Programmer has insufficiently begged\n");
-        exit(1);
+        return 0;
     }
+    return 1;
 }
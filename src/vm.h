@@ -1,27 +1,86 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "compiler.h"
+#include "when_queue.h"
 
-typedef struct {
-    size_t count;
-    size_t capacity;
-    char *string;
-} String_Builder;
+#define MAX_SCOPE 16
+#define STACK_SIZE 1024
+#define RETURN_STACK_SIZE 256
 
+/* A deterministic run seeds the beg check with seed and reads its hour
+ * from clock, in UTC, instead of the wall clock. With a replay file, or
+ * in a deterministic run, input ends the program once there is none left
+ * rather than reading an empty line. A snapshot is written on SIGUSR1
+ * and, if snapshot_every is set, every that many instructions. */
 typedef struct {
-    int val1;
-    int val2;
-    int loc;
-    uint8_t mode;
-    uint8_t is_promise;
-    int8_t cond;
-} When;
+    const char *trace_path;
+    int deterministic;
+    unsigned seed;
+    long long clock;
+    const char *replay_path;
+    const char *record_path;
+    const char *snapshot_path;
+    long long snapshot_every;
+    const char *restore_path;
+    long long max_instructions;
+    int hwcounters;
+    FILE *input;
+    FILE *record;
+    FILE *output;
+} Run_Options;
+
+typedef enum {
+    VM_YIELDED,
+    VM_NEEDS_INPUT,
+    VM_HALTED,
+    VM_FAILED,
+} Vm_Status;
 
+/* A program's whole run state. The interpreter loads it into locals when
+ * it starts and stores it back when it stops, so a run can be resumed.
+ * countdown is how many more instructions run before the next checkpoint,
+ * where executed catches up and the VM yields once it reaches fuel_end.
+ * A hosted VM does not read a file: it stops with VM_NEEDS_INPUT until
+ * the host sets input_ready with up to 63 bytes in input, or input_ended. */
 typedef struct {
-    size_t count;
-    size_t capacity;
-    When *whens;
-} When_Queue;
+    Code *code;
+    Run_Options *options;
+    int headroom;
+    Vm_Status status;
+    Value *stack_ptr;
+    Value *return_stack_ptr;
+    Value *vars;
+    int vars_count;
+    int scope;
+    int cur_byte;
+    int cur_function;
+    When_Queue when_queue;
+    long long countdown;
+    long long executed;
+    long long next_snapshot;
+    long long interval;
+    long long fuel_end;
+    int hosted;
+    int waiting;
+    int input_ready;
+    int input_ended;
+    size_t input_len;
+    char input[64];
+    Value *frame_base[MAX_SCOPE];
+    Value stack[STACK_SIZE];
+    Value return_stack[RETURN_STACK_SIZE];
+} Vm;
 
-void run_bytecode(Code *code);
-char *disassemble(Code *code);
+Array *array_new(Array_Kind kind, size_t len);
+size_t array_elem_size(Array_Kind kind);
+int verify(Code *code);
+Vm *vm_new(Code *code, int headroom, Run_Options *options);
+Vm_Status vm_run(Vm *vm);
+Vm_Status vm_run_for(Vm *vm, long long fuel);
+long long vm_executed(Vm *vm);
+void vm_free(Vm *vm);
+void run_bytecode(Code *code, Run_Options *options);
+char *op_name(uint8_t op);
+void disassemble(Code *code, FILE *out);
@@ -0,0 +1,438 @@
+/* The interpreter loop, included four times by vm.c: as run_loop for
+ * verified code, as run_loop_checked, as run_loop_traced, which also
+ * records every dispatch, and as run_loop_counted, which reads the
+ * hardware counters before each one. The includer defines RUN_LOOP,
+ * CHECKED and TRACE_STEP. The VM's state lives in locals while the loop runs and is
+ * saved back on every way out. */
+
+Vm_Status RUN_LOOP(Vm *vm) {
+    Code *code = vm->code;
+    Run_Options *options = vm->options;
+    FILE *output = options->output;
+    Value *stack = vm->stack;
+    Value *return_stack = vm->return_stack;
+    Value *stack_limit = stack + STACK_SIZE - vm->headroom;
+    Value *return_limit = return_stack + RETURN_STACK_SIZE - 1;
+    Value **frame_base = vm->frame_base;
+
+    Value *stack_ptr = vm->stack_ptr;
+    Value *return_stack_ptr = vm->return_stack_ptr;
+    Value *vars = vm->vars;
+    When_Queue when_queue = vm->when_queue;
+    int vars_count = vm->vars_count;
+    int scope = vm->scope;
+    int cur_byte = vm->cur_byte;
+    int cur_function = vm->cur_function;
+    long long countdown = vm->countdown;
+    Vm_Status status = VM_HALTED;
+
+    while (code->bytes[cur_byte] != OP_HLT) {
+        if (--countdown < 0) {
+            SAVE_STATE();
+            countdown = checkpoint(vm);
+            if (vm->executed >= vm->fuel_end) {
+                status = VM_YIELDED;
+                goto stop;
+            }
+            countdown--;
+        }
+        TRACE_STEP();
+        CHECK_STEP();
+        int op_byte = cur_byte;
+
+        switch (code->bytes[cur_byte]) {
+        case OP_CONST:
+            push(&stack_ptr, code->constant_list->constants[consume_byte(code, &cur_byte)]);
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_INC:
+            push_i(&stack_ptr, pop_i(&stack_ptr)+1);
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_DEC:
+            push_i(&stack_ptr, pop_i(&stack_ptr)-1);
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_INC_F:
+            push_r(&stack_ptr, pop_r(&stack_ptr)+1);
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_DEC_F:
+            push_r(&stack_ptr, pop_r(&stack_ptr)-1);
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_SET_VAR: {
+            int index = consume_byte(code, &cur_byte) + scope*256;
+            int val = consume_byte(code, &cur_byte);
+            set_var(&vars[index], value_int(val));
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_PUSH: {
+            int index = consume_byte(code, &cur_byte) + scope*256;
+            value_retain(vars[index]);
+            push(&stack_ptr, vars[index]);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_PUSHI:
+            push_i(&stack_ptr, consume_byte(code, &cur_byte));
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_POP:
+            set_var(&vars[consume_byte(code, &cur_byte) + scope*256], pop(&stack_ptr));
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_CALL:
+            consume_byte(code, &cur_byte);
+            char *func_name = (char *)&code->bytes[cur_byte];
+            for (unsigned i = 0; i < code->function_list->count; i++) {
+                if (strcmp(func_name, code->function_list->functions[i].name) == 0) {
+                    while (code->bytes[cur_byte] != 0) {
+                        consume_byte(code, &cur_byte);
+                    }
+                    consume_byte(code, &cur_byte);
+
+                    push_i(&return_stack_ptr, cur_byte);
+                    cur_byte = enter_function(code, i);
+                    cur_function = i;
+                    if (cur_byte == -1) goto fail;
+
+                    scope++;
+                    /* The input slot can be left above the frame by a deeper call */
+                    release_values(vars + scope*256, vars + vars_count);
+                    vars = allocate_scope(vars, scope);
+                    vars_count = (scope+1)*256;
+                    if (scope >= MAX_SCOPE) {
+                        fprintf(stderr, "%d: The scope is too deep\n", source_line(code, op_byte));
+                        goto fail;
+                    }
+                    frame_base[scope] = stack_ptr - code->function_list->functions[i].stack_args;
+                    CHECK_TRANSFER();
+                    break;
+                }
+                if (i == code->function_list->count - 1) {
+                    if (strcmp(func_name, "print") == 0) {
+                        Value v = pop(&stack_ptr);
+                        if (!value_is_array(v)) {
+                            char c = (char)value_as_int(v);
+                            fputc(c, output);
+                            push_i(&stack_ptr, c);
+                        }
+                        else {
+                            Array *char_array = value_as_array(v);
+                            if (char_array->kind == ARRAY_CHAR) {
+                                fwrite(char_array->items.bytes, 1, char_array->len, output);
+                            }
+                            else {
+                                for (unsigned j = 0; j < char_array->len; j++) {
+                                    fputc((char)char_array->items.words[j].integer, output);
+                                }
+                            }
+                            push_p(&stack_ptr, char_array);
+                        }
+
+                        while (code->bytes[cur_byte] != 0) {
+                            consume_byte(code, &cur_byte);
+                        }
+                        consume_byte(code, &cur_byte);
+                    }
+                }
+            }
+            break;
+        case OP_RET: {
+            if (!check_promises(code, &when_queue, cur_function, cur_byte)) goto fail;
+            cur_byte = pop_i(&return_stack_ptr);
+
+            /* Values the callee's statements left under its result and
+             * its variables die with the call */
+            Value result = pop(&stack_ptr);
+            release_values(frame_base[scope], stack_ptr);
+            stack_ptr = frame_base[scope];
+            push(&stack_ptr, result);
+            release_values(vars + scope*256, vars + (scope+1)*256);
+            scope--;
+            CHECK_TRANSFER();
+            break;
+        }
+        case OP_TAILCALL: {
+            char *func_name = (char *)&code->bytes[cur_byte+1];
+            int function = strcmp(func_name, code->function_list->functions[cur_function].name) == 0
+                ? cur_function
+                : find_function(code, func_name);
+
+            if (!check_promises(code, &when_queue, cur_function, cur_byte)) goto fail;
+
+            int args = code->function_list->functions[function].stack_args;
+            release_values(frame_base[scope], stack_ptr - args);
+            memmove(frame_base[scope], stack_ptr - args, args*sizeof(Value));
+            stack_ptr = frame_base[scope] + args;
+            release_values(vars + scope*256, vars + (scope+1)*256);
+            memset(vars + scope*256, 0, 256*sizeof(Value));
+
+            cur_byte = enter_function(code, function);
+            cur_function = function;
+            if (cur_byte == -1) goto fail;
+            CHECK_TRANSFER();
+            break;
+        }
+        case OP_RETS:
+            cur_byte = pop_i(&return_stack_ptr);
+            CHECK_TRANSFER();
+            break;
+        case OP_BEG:
+            if (!check_beg_text((char *)&code->bytes[cur_byte+1], options)) goto fail;
+            while (code->bytes[cur_byte] != 0) {
+                consume_byte(code, &cur_byte);
+            }
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_FNCTN:
+            while (code->bytes[cur_byte] != 0) {
+                consume_byte(code, &cur_byte);
+            }
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_INPUT: {
+            /* A hosted VM stops here until it is given a line, having
+             * written the newline that prompts for it once */
+            if (!vm->waiting) fputc('\n', output);
+            if (vm->hosted && !vm->input_ready && !vm->input_ended) {
+                /* It runs again once there is input, and is counted then */
+                countdown++;
+                vm->waiting = 1;
+                status = VM_NEEDS_INPUT;
+                goto stop;
+            }
+            vm->waiting = 0;
+
+            Array *input = array_new(ARRAY_CHAR, 64);
+            set_var(&vars[vars_count-1], value_array(input));
+
+            char *buf = (char *)input->items.bytes;
+            if (vm->hosted) {
+                if (!vm->input_ready) goto halt;
+                memcpy(buf, vm->input, vm->input_len);
+                buf[vm->input_len] = '\0';
+                vm->input_ready = 0;
+            }
+            else if (options->input == NULL || fgets(buf, 64, options->input) == NULL) {
+                if (options->input != stdin) goto halt;
+                buf[0] = '\0';
+            }
+            input->len = strcspn(buf, "\n");
+            if (options->record) fprintf(options->record, "%.*s\n", (int)input->len, buf);
+
+            value_retain(vars[vars_count-1]);
+            push(&stack_ptr, vars[vars_count-1]);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_JMP:
+            cur_byte = code->line_positions->positions[pop_i(&stack_ptr)];
+            CHECK_TRANSFER();
+            break;
+        case OP_JMPB:
+            cur_byte = pop_i(&stack_ptr);
+            CHECK_TRANSFER();
+            break;
+        case OP_WHEN:
+        case OP_WHEN_NOT:
+        case OP_PROMISE:
+        case OP_PROMISE_NOT: {
+            uint8_t op = code->bytes[cur_byte];
+            int mode = pop_i(&stack_ptr);
+            int val2 = pop_i(&stack_ptr);
+            int val1 = pop_i(&stack_ptr);
+            when_queue_add(&when_queue, op == OP_WHEN || op == OP_PROMISE, val1, val2, cur_byte+1, mode, op == OP_PROMISE || op == OP_PROMISE_NOT);
+            consume_byte(code, &cur_byte);
+            skip_instruction(code, &cur_byte);
+            break;
+        }
+        case OP_TEST:
+        case OP_TEST_NOT: {
+            uint8_t op = code->bytes[cur_byte];
+            int mode = pop_i(&stack_ptr);
+            int val2 = pop_i(&stack_ptr);
+            int val1 = pop_i(&stack_ptr);
+            if (mode & 1) val1 = value_as_int(vars[val1]);
+            if (mode & 2) val2 = value_as_int(vars[val2]);
+            consume_byte(code, &cur_byte);
+            if ((val1 == val2) != (op == OP_TEST)) skip_instruction(code, &cur_byte);
+            break;
+        }
+        case OP_TEST_F:
+        case OP_TEST_NOT_F: {
+            uint8_t op = code->bytes[cur_byte];
+            int mode = pop_i(&stack_ptr);
+            Value val2 = pop(&stack_ptr);
+            Value val1 = pop(&stack_ptr);
+            if (mode & 1) val1 = vars[value_as_int(val1)];
+            if (mode & 2) val2 = vars[value_as_int(val2)];
+            consume_byte(code, &cur_byte);
+            if ((value_as_real(val1) == value_as_real(val2)) != (op == OP_TEST_F)) skip_instruction(code, &cur_byte);
+            break;
+        }
+        case OP_POPR:
+            pop(&return_stack_ptr);
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_DROP:
+            value_release(pop(&stack_ptr));
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_JMPS:
+            push_i(&return_stack_ptr, cur_byte+1);
+            cur_byte = code->line_positions->positions[pop_i(&stack_ptr)];
+            CHECK_TRANSFER();
+            break;
+        case OP_JMPBS:
+            push_i(&return_stack_ptr, cur_byte+1);
+            cur_byte = pop_i(&stack_ptr);
+            CHECK_TRANSFER();
+            break;
+        case OP_JMPBSI:
+            push_i(&return_stack_ptr, cur_byte+2);
+            cur_byte = consume_byte(code, &cur_byte);
+            CHECK_TRANSFER();
+            break;
+        case OP_JMPBSC:
+            push_i(&return_stack_ptr, cur_byte+2);
+            cur_byte = value_as_int(code->constant_list->constants[consume_byte(code, &cur_byte)]);
+            CHECK_TRANSFER();
+            break;
+        case OP_ADD:
+            push_i(&stack_ptr, pop_i(&stack_ptr)+pop_i(&stack_ptr));
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_SUB: {
+            int num1 = pop_i(&stack_ptr);
+            int num2 = pop_i(&stack_ptr);
+            push_i(&stack_ptr, num2 - num1);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_ADD_F:
+            push_r(&stack_ptr, pop_r(&stack_ptr)+pop_r(&stack_ptr));
+            consume_byte(code, &cur_byte);
+            break;
+        case OP_SUB_F: {
+            float num1 = pop_r(&stack_ptr);
+            float num2 = pop_r(&stack_ptr);
+            push_r(&stack_ptr, num2 - num1);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SET_ARRAY: {
+            int index = consume_byte(code, &cur_byte) + scope*256;
+            Array_Kind kind = consume_byte(code, &cur_byte);
+            set_var(&vars[index], value_array(array_new(kind, 16)));
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SET_INDEX: {
+            int val = pop_i(&stack_ptr);
+            int index = pop_i(&stack_ptr);
+            array_set(value_as_array(vars[pop_i(&stack_ptr) + scope*256]), index, val);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SET_INDEX_I: {
+            int val = pop_i(&stack_ptr);
+            int index = pop_i(&stack_ptr);
+            value_as_array(vars[pop_i(&stack_ptr) + scope*256])->items.words[index].integer = val;
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SET_INDEX_C: {
+            int val = pop_i(&stack_ptr);
+            int index = pop_i(&stack_ptr);
+            value_as_array(vars[pop_i(&stack_ptr) + scope*256])->items.bytes[index] = (uint8_t)val;
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SET_LEN: {
+            int array = pop_i(&stack_ptr) + scope*256;
+            int len = pop_i(&stack_ptr);
+            array_resize(value_as_array(vars[array]), len);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SETP_INDEX: {
+            int val = pop_i(&stack_ptr);
+            int index = pop_i(&stack_ptr);
+            Array *array = value_as_array(vars[pop_i(&stack_ptr) + scope*256]);
+            array_set(array, index, val);
+            push_i(&stack_ptr, array_get(array, index));
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SETP_INDEX_I: {
+            int val = pop_i(&stack_ptr);
+            int index = pop_i(&stack_ptr);
+            value_as_array(vars[pop_i(&stack_ptr) + scope*256])->items.words[index].integer = val;
+            push_i(&stack_ptr, val);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SETP_INDEX_C: {
+            uint8_t val = (uint8_t)pop_i(&stack_ptr);
+            int index = pop_i(&stack_ptr);
+            value_as_array(vars[pop_i(&stack_ptr) + scope*256])->items.bytes[index] = val;
+            push_i(&stack_ptr, val);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_SETP_LEN: {
+            int array = pop_i(&stack_ptr) + scope*256;
+            int len = pop_i(&stack_ptr);
+            array_resize(value_as_array(vars[array]), len);
+            push_i(&stack_ptr, len);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_PUSH_INDEX: {
+            int index = pop_i(&stack_ptr);
+            push_i(&stack_ptr, array_get(value_as_array(vars[pop_i(&stack_ptr) + scope*256]), index));
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_PUSH_INDEX_I: {
+            int index = pop_i(&stack_ptr);
+            push_i(&stack_ptr, value_as_array(vars[pop_i(&stack_ptr) + scope*256])->items.words[index].integer);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_PUSH_INDEX_C: {
+            int index = pop_i(&stack_ptr);
+            push_i(&stack_ptr, value_as_array(vars[pop_i(&stack_ptr) + scope*256])->items.bytes[index]);
+            consume_byte(code, &cur_byte);
+            break;
+        }
+        case OP_BULK:
+            run_bulk_loop(code, cur_byte, vars, scope, &when_queue, code->function_list->functions[cur_function].location);
+            cur_byte += 4 + 3*code->bytes[cur_byte+3];
+            break;
+        default: break;
+        }
+
+        if (when_queue.count > 0) {
+            int fired = when_queue_poll(&when_queue, vars, code->function_list->functions[cur_function].location, cur_byte);
+            if (fired != -1) {
+                cur_byte = when_queue.loc[fired];
+                when_queue_remove(&when_queue, fired);
+            }
+        }
+    }
+
+halt:
+    mem_profile_snapshot();
+    status = VM_HALTED;
+    goto stop;
+fail:
+    status = VM_FAILED;
+stop:
+    SAVE_STATE();
+    vm->status = status;
+    return status;
+}
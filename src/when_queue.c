@@ -0,0 +1,216 @@
+#include <stdlib.h>
+
+#include "alloc.h"
+#include "when_queue.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define WHEN_QUEUE_SIMD
+#endif
+
+/* Shorter queues are polled one entry at a time */
+#define WHEN_QUEUE_SIMD_MIN 8
+
+/* Dead entries tolerated before the queue is compacted */
+#define WHEN_QUEUE_DEAD_MIN 32
+
+void when_queue_reserve(When_Queue *when_queue, size_t capacity) {
+    when_queue->capacity = capacity;
+    when_queue->val1 = plea_realloc(SITE_WHENS, when_queue->val1, capacity * sizeof(int32_t));
+    when_queue->val2 = plea_realloc(SITE_WHENS, when_queue->val2, capacity * sizeof(int32_t));
+    when_queue->loc = plea_realloc(SITE_WHENS, when_queue->loc, capacity * sizeof(int32_t));
+    when_queue->mode = plea_realloc(SITE_WHENS, when_queue->mode, capacity * sizeof(int32_t));
+    when_queue->cond = plea_realloc(SITE_WHENS, when_queue->cond, capacity * sizeof(int32_t));
+    when_queue->is_promise = plea_realloc(SITE_WHENS, when_queue->is_promise, capacity);
+}
+
+void when_queue_init(When_Queue *when_queue) {
+    *when_queue = (When_Queue){0};
+    when_queue_reserve(when_queue, 4);
+}
+
+void when_queue_free(When_Queue *when_queue) {
+    plea_free(when_queue->val1);
+    plea_free(when_queue->val2);
+    plea_free(when_queue->loc);
+    plea_free(when_queue->mode);
+    plea_free(when_queue->cond);
+    plea_free(when_queue->is_promise);
+}
+
+/* Drops the dead entries, keeping the live ones in order */
+void when_queue_compact(When_Queue *when_queue) {
+    size_t count = 0;
+    for (size_t i = 0; i < when_queue->count; i++) {
+        if (when_queue->cond[i] == -1) continue;
+        when_queue->val1[count] = when_queue->val1[i];
+        when_queue->val2[count] = when_queue->val2[i];
+        when_queue->loc[count] = when_queue->loc[i];
+        when_queue->mode[count] = when_queue->mode[i];
+        when_queue->cond[count] = when_queue->cond[i];
+        when_queue->is_promise[count] = when_queue->is_promise[i];
+        count++;
+    }
+    when_queue->count = count;
+    when_queue->dead = 0;
+}
+
+void when_queue_add(When_Queue *when_queue, uint8_t cond, int val1, int val2, int loc, uint8_t mode, uint8_t is_promise) {
+    if (when_queue->dead >= WHEN_QUEUE_DEAD_MIN && when_queue->dead*2 >= when_queue->count) {
+        when_queue_compact(when_queue);
+    }
+    if (when_queue->count == when_queue->capacity) {
+        when_queue_reserve(when_queue, when_queue->capacity * 2);
+    }
+
+    size_t i = when_queue->count++;
+    when_queue->val1[i] = val1;
+    when_queue->val2[i] = val2;
+    when_queue->loc[i] = loc;
+    when_queue->mode[i] = mode;
+    when_queue->cond[i] = cond;
+    when_queue->is_promise[i] = is_promise;
+}
+
+void when_queue_kill(When_Queue *when_queue, size_t i) {
+    when_queue->cond[i] = -1;
+    when_queue->dead++;
+}
+
+/* Kills entry i and drops any dead entries left at the end */
+void when_queue_remove(When_Queue *when_queue, size_t i) {
+    when_queue_kill(when_queue, i);
+    while (when_queue->count > 0 && when_queue->cond[when_queue->count-1] == -1) {
+        when_queue->count--;
+        when_queue->dead--;
+    }
+}
+
+int when_queue_poll_scalar(When_Queue *when_queue, size_t from, Value *vars, int function_location, int cur_byte) {
+    for (size_t i = from; i < when_queue->count; i++) {
+        if (when_queue->cond[i] == -1 || when_queue->loc[i] < function_location) continue;
+
+        int val1 = (when_queue->mode[i] & 1) ? value_as_int(vars[when_queue->val1[i]]) : when_queue->val1[i];
+        int val2 = (when_queue->mode[i] & 2) ? value_as_int(vars[when_queue->val2[i]]) : when_queue->val2[i];
+        int equal = (when_queue->mode[i] & WHEN_REAL)
+            ? (Value32){ .integer = val1 }.real == (Value32){ .integer = val2 }.real
+            : val1 == val2;
+        if (equal == when_queue->cond[i]) return (int)i;
+        if (when_queue->loc[i] > cur_byte) when_queue_kill(when_queue, i);
+    }
+    return -1;
+}
+
+#ifdef WHEN_QUEUE_SIMD
+/* Applies a block's kills up to the first entry that fires, as the scalar
+ * poll would have, and returns that entry or -1 */
+int when_queue_settle(When_Queue *when_queue, size_t i, int fires, int kills) {
+    if (fires) kills &= (1 << __builtin_ctz(fires)) - 1;
+    for (; kills; kills &= kills - 1) when_queue_kill(when_queue, i + __builtin_ctz(kills));
+    return fires ? (int)i + __builtin_ctz(fires) : -1;
+}
+
+/* Lanes of a block that are equal, as floats for WHEN_REAL entries */
+static inline __m128i when_queue_equal_sse2(__m128i mode, __m128i val1, __m128i val2) {
+    __m128i four = _mm_set1_epi32(WHEN_REAL);
+    __m128i is_real = _mm_cmpeq_epi32(_mm_and_si128(mode, four), four);
+    __m128i real = _mm_castps_si128(_mm_cmpeq_ps(_mm_castsi128_ps(val1), _mm_castsi128_ps(val2)));
+    return _mm_or_si128(_mm_and_si128(is_real, real), _mm_andnot_si128(is_real, _mm_cmpeq_epi32(val1, val2)));
+}
+
+/* An int Value keeps its payload in the upper half, the second int of the
+ * pair on x86 */
+int when_queue_poll_sse2(When_Queue *when_queue, Value *vars, int function_location, int cur_byte) {
+    const int32_t *payload = (const int32_t *)vars + 1;
+    __m128i one = _mm_set1_epi32(1);
+    __m128i dead = _mm_set1_epi32(-1);
+    __m128i lower = _mm_set1_epi32(function_location - 1);
+    __m128i here = _mm_set1_epi32(cur_byte);
+
+    size_t i = 0;
+    for (; i + 4 <= when_queue->count; i += 4) {
+        int32_t val1[4], val2[4];
+        for (int k = 0; k < 4; k++) {
+            /* Branch-free: literal lanes read slot 0 and mask it away */
+            int32_t is_var1 = -(when_queue->mode[i+k] & 1);
+            int32_t is_var2 = -((when_queue->mode[i+k] >> 1) & 1);
+            val1[k] = (payload[2*(when_queue->val1[i+k] & is_var1)] & is_var1) | (when_queue->val1[i+k] & ~is_var1);
+            val2[k] = (payload[2*(when_queue->val2[i+k] & is_var2)] & is_var2) | (when_queue->val2[i+k] & ~is_var2);
+        }
+
+        __m128i cond = _mm_loadu_si128((const __m128i *)&when_queue->cond[i]);
+        __m128i loc = _mm_loadu_si128((const __m128i *)&when_queue->loc[i]);
+        __m128i mode = _mm_loadu_si128((const __m128i *)&when_queue->mode[i]);
+        __m128i equal = _mm_and_si128(when_queue_equal_sse2(mode, _mm_loadu_si128((const __m128i *)val1), _mm_loadu_si128((const __m128i *)val2)), one);
+        __m128i in_range = _mm_cmpgt_epi32(loc, lower);
+        __m128i fire = _mm_and_si128(_mm_cmpeq_epi32(equal, cond), in_range);
+        __m128i live = _mm_andnot_si128(_mm_cmpeq_epi32(cond, dead), in_range);
+        __m128i kill = _mm_andnot_si128(fire, _mm_and_si128(live, _mm_cmpgt_epi32(loc, here)));
+
+        int fires = _mm_movemask_ps(_mm_castsi128_ps(fire));
+        int kills = _mm_movemask_ps(_mm_castsi128_ps(kill));
+        if (fires | kills) {
+            int fired = when_queue_settle(when_queue, i, fires, kills);
+            if (fired != -1) return fired;
+        }
+    }
+    return when_queue_poll_scalar(when_queue, i, vars, function_location, cur_byte);
+}
+
+__attribute__((target("avx2")))
+int when_queue_poll_avx2(When_Queue *when_queue, Value *vars, int function_location, int cur_byte) {
+    const int *payload = (const int *)vars + 1;
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i two = _mm256_set1_epi32(2);
+    __m256i four = _mm256_set1_epi32(WHEN_REAL);
+    __m256i dead = _mm256_set1_epi32(-1);
+    __m256i lower = _mm256_set1_epi32(function_location - 1);
+    __m256i here = _mm256_set1_epi32(cur_byte);
+
+    size_t i = 0;
+    for (; i + 8 <= when_queue->count; i += 8) {
+        __m256i mode = _mm256_loadu_si256((const __m256i *)&when_queue->mode[i]);
+        __m256i val1 = _mm256_loadu_si256((const __m256i *)&when_queue->val1[i]);
+        __m256i val2 = _mm256_loadu_si256((const __m256i *)&when_queue->val2[i]);
+        __m256i is_var1 = _mm256_cmpeq_epi32(_mm256_and_si256(mode, one), one);
+        __m256i is_var2 = _mm256_cmpeq_epi32(_mm256_and_si256(mode, two), two);
+        val1 = _mm256_mask_i32gather_epi32(val1, payload, _mm256_slli_epi32(val1, 1), is_var1, 4);
+        val2 = _mm256_mask_i32gather_epi32(val2, payload, _mm256_slli_epi32(val2, 1), is_var2, 4);
+
+        __m256i cond = _mm256_loadu_si256((const __m256i *)&when_queue->cond[i]);
+        __m256i loc = _mm256_loadu_si256((const __m256i *)&when_queue->loc[i]);
+        __m256i is_real = _mm256_cmpeq_epi32(_mm256_and_si256(mode, four), four);
+        __m256i real = _mm256_castps_si256(_mm256_cmp_ps(_mm256_castsi256_ps(val1), _mm256_castsi256_ps(val2), _CMP_EQ_OQ));
+        __m256i equal = _mm256_and_si256(_mm256_blendv_epi8(_mm256_cmpeq_epi32(val1, val2), real, is_real), one);
+        __m256i in_range = _mm256_cmpgt_epi32(loc, lower);
+        __m256i fire = _mm256_and_si256(_mm256_cmpeq_epi32(equal, cond), in_range);
+        __m256i live = _mm256_andnot_si256(_mm256_cmpeq_epi32(cond, dead), in_range);
+        __m256i kill = _mm256_andnot_si256(fire, _mm256_and_si256(live, _mm256_cmpgt_epi32(loc, here)));
+
+        int fires = _mm256_movemask_ps(_mm256_castsi256_ps(fire));
+        int kills = _mm256_movemask_ps(_mm256_castsi256_ps(kill));
+        if (fires | kills) {
+            int fired = when_queue_settle(when_queue, i, fires, kills);
+            if (fired != -1) return fired;
+        }
+    }
+    return when_queue_poll_scalar(when_queue, i, vars, function_location, cur_byte);
+}
+
+static int (*when_queue_poll_blocks)(When_Queue *, Value *, int, int) = NULL;
+#endif
+
+/* Runs after every instruction. Returns the first entry, in the order they
+ * were registered, whose condition holds, or -1; live entries checked
+ * before it that were registered past cur_byte die. */
+int when_queue_poll(When_Queue *when_queue, Value *vars, int function_location, int cur_byte) {
+#ifdef WHEN_QUEUE_SIMD
+    if (when_queue->count >= WHEN_QUEUE_SIMD_MIN) {
+        if (when_queue_poll_blocks == NULL) {
+            when_queue_poll_blocks = __builtin_cpu_supports("avx2") ? when_queue_poll_avx2 : when_queue_poll_sse2;
+        }
+        return when_queue_poll_blocks(when_queue, vars, function_location, cur_byte);
+    }
+#endif
+    return when_queue_poll_scalar(when_queue, 0, vars, function_location, cur_byte);
+}
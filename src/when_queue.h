@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compiler.h"
+
+/* Registered whens as parallel arrays, so a poll can compare a block of
+ * them at once. cond is 1 or 0 for a live entry and -1 once it fired or
+ * died; dead entries are squeezed out, in order, when they make up half
+ * the queue. mode bit 1 and 2 mark val1 and val2 as variable slots and
+ * WHEN_REAL compares them as floats. */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    size_t dead;
+    int32_t *val1;
+    int32_t *val2;
+    int32_t *loc;
+    int32_t *mode;
+    int32_t *cond;
+    uint8_t *is_promise;
+} When_Queue;
+
+void when_queue_init(When_Queue *when_queue);
+void when_queue_free(When_Queue *when_queue);
+void when_queue_add(When_Queue *when_queue, uint8_t cond, int val1, int val2, int loc, uint8_t mode, uint8_t is_promise);
+void when_queue_remove(When_Queue *when_queue, size_t i);
+int when_queue_poll(When_Queue *when_queue, Value *vars, int function_location, int cur_byte);